@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "mnist_loader.h"
+#include "hog.h"
+#include "naive_bayes.h"
+#include "parallel.h"
+#include "utils.h"
+
+// Benchmarks for the classifier hot paths. Run from the repository root:
+//   bin/benchmark scoring [MODEL_FILE]
+//   bin/benchmark quantized [MODEL_FILE]
+//   bin/benchmark incremental [MODEL_FILE]
+//   bin/benchmark hog
+//   bin/benchmark gradient
+//   bin/benchmark training
+//   bin/benchmark update
+// A MODEL_FILE is a letters model saved by "mnist_classifier train letters".
+// It was trained on upright images, so the test images are transformed the
+// same way before they are scored with it.
+
+// Parameters used by mnist_classifier
+#define CELL_SIZE 4
+#define NUM_BINS 9
+#define MODEL_BINS 32
+#define NUM_CLASSES 26
+
+static const char *TRAIN_IMAGES = "data/emnist-letters-train-images-idx3-ubyte";
+static const char *TRAIN_LABELS = "data/emnist-letters-train-labels-idx1-ubyte";
+static const char *TEST_IMAGES = "data/emnist-letters-test-images-idx3-ubyte";
+static const char *TEST_LABELS = "data/emnist-letters-test-labels-idx1-ubyte";
+
+// Load a dataset with 0-based labels and extract its HOG features. With
+// upright set the images are transformed the way saved models are trained.
+static int loadFeatures(const char *imageFile, const char *labelFile, int upright,
+                        MNISTDataset *dataset, HOGFeatures *hogFeatures) {
+    if (!loadMNISTDataset(imageFile, labelFile, dataset)) {
+        printf("Failed to load %s. Check that files exist in the data/ directory.\n", imageFile);
+        return 0;
+    }
+    if (upright) {
+        transformEMNISTDataset(dataset);
+    }
+    for (uint32_t i = 0; i < dataset->numImages; i++) {
+        if (dataset->labels[i] > 0) {
+            dataset->labels[i] -= 1;
+        }
+    }
+
+    hogFeatures->numImages = dataset->numImages;
+    hogFeatures->numFeatures = (dataset->rows/CELL_SIZE) * (dataset->cols/CELL_SIZE) * NUM_BINS;
+    extractHOGFeaturesParallel(dataset, hogFeatures, CELL_SIZE, NUM_BINS, 0);
+    return hogFeatures->features != NULL;
+}
+
+// Map a saved model, or train one on the EMNIST letters training set
+static int getModel(const char *modelFile, NaiveBayesModel *model) {
+    if (modelFile != NULL) {
+        if (!mapNaiveBayes(model, modelFile, CELL_SIZE, NUM_BINS)) {
+            return 0;
+        }
+        if (model->numClasses != NUM_CLASSES) {
+            printf("Model %s has %d classes; the benchmarks need a %d-class letters model\n",
+                   modelFile, model->numClasses, NUM_CLASSES);
+            freeNaiveBayes(model);
+            return 0;
+        }
+        return 1;
+    }
+
+    MNISTDataset trainDataset;
+    HOGFeatures trainHOG;
+    if (!loadFeatures(TRAIN_IMAGES, TRAIN_LABELS, 0, &trainDataset, &trainHOG)) {
+        return 0;
+    }
+
+    int ok = initNaiveBayes(model, NUM_CLASSES, trainHOG.numFeatures, MODEL_BINS, 1.0);
+    if (ok) {
+        trainNaiveBayes(model, &trainHOG);
+    }
+
+    freeMNISTDataset(&trainDataset);
+    freeHOGFeatures(&trainHOG);
+    return ok;
+}
+
+// The scoring loop as it was before log-probability tables: one log() per
+// class per feature over a table of plain probabilities
+static uint8_t legacyPredict(const NaiveBayesModel *model, const double *classPrior,
+                             const double *featureProb, const double *features) {
+    double maxLogProb = -INFINITY;
+    int bestClass = 0;
+
+    for (int c = 0; c < model->numClasses; c++) {
+        double logProb = log(classPrior[c]);
+
+        for (uint32_t f = 0; f < model->numFeatures; f++) {
+            double featureVal = features[f];
+            featureVal = (featureVal < 0) ? 0 : (featureVal > 1.0 ? 1.0 : featureVal);
+
+            int bin = (int)(featureVal / model->binWidth);
+            bin = (bin < 0) ? 0 : (bin >= model->numBins ? model->numBins - 1 : bin);
+
+            double prob = featureProb[((size_t)c * model->numFeatures + f) * model->numBins + bin];
+            prob = (prob < 1e-10) ? 1e-10 : prob;
+
+            logProb += log(prob);
+        }
+
+        if (logProb > maxLogProb) {
+            maxLogProb = logProb;
+            bestClass = c;
+        }
+    }
+
+    return (uint8_t)bestClass;
+}
+
+// Class-outer, feature-inner scoring over the class-major log table: every
+// feature's bin is recomputed for each class
+static uint8_t classMajorPredict(const NaiveBayesModel *model, const double *features) {
+    double maxLogProb = -INFINITY;
+    int bestClass = 0;
+
+    for (int c = 0; c < model->numClasses; c++) {
+        double logProb = model->classScoreBias[c];
+
+        for (uint32_t f = 0; f < model->numFeatures; f++) {
+            double featureVal = features[f];
+            featureVal = (featureVal < 0) ? 0 : (featureVal > 1.0 ? 1.0 : featureVal);
+
+            int bin = (int)(featureVal / model->binWidth);
+            bin = (bin < 0) ? 0 : (bin >= model->numBins ? model->numBins - 1 : bin);
+
+            logProb += featureLogCountRow(model, c, f)[bin];
+        }
+
+        if (logProb > maxLogProb) {
+            maxLogProb = logProb;
+            bestClass = c;
+        }
+    }
+
+    return (uint8_t)bestClass;
+}
+
+// Per-image scoring latency of the legacy loop, the class-major table loop
+// and predictNaiveBayes
+static int benchScoring(const char *modelFile) {
+    MNISTDataset testDataset;
+    HOGFeatures testHOG;
+    NaiveBayesModel model;
+
+    if (!getModel(modelFile, &model)) {
+        return 1;
+    }
+    if (!loadFeatures(TEST_IMAGES, TEST_LABELS, modelFile != NULL, &testDataset, &testHOG)) {
+        freeNaiveBayes(&model);
+        return 1;
+    }
+
+    // Rebuild the plain probability tables the legacy loop reads
+    size_t tableSize = (size_t)model.numClasses * model.numFeatures * model.numBins;
+    double *classPrior = (double*)malloc(model.numClasses * sizeof(double));
+    double *featureProb = (double*)malloc(tableSize * sizeof(double));
+    if (classPrior == NULL || featureProb == NULL) {
+        printf("Failed to allocate memory for legacy tables\n");
+        free(classPrior);
+        free(featureProb);
+        freeMNISTDataset(&testDataset);
+        freeHOGFeatures(&testHOG);
+        freeNaiveBayes(&model);
+        return 1;
+    }
+    for (int c = 0; c < model.numClasses; c++) {
+        classPrior[c] = exp(model.classLogPrior[c]);
+    }
+    for (size_t i = 0; i < tableSize; i++) {
+        int c = (int)(i / ((size_t)model.numFeatures * model.numBins));
+        featureProb[i] = exp(model.featureLogCount[i] - model.classLogDenom[c]);
+    }
+
+    uint32_t n = testHOG.numImages;
+    uint32_t agree = 0;
+    volatile uint8_t sink = 0;
+
+    double start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        sink = legacyPredict(&model, classPrior, featureProb, &testHOG.features[i * testHOG.numFeatures]);
+    }
+    double legacyTime = getTimeSeconds() - start;
+
+    start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        sink = classMajorPredict(&model, &testHOG.features[i * testHOG.numFeatures]);
+    }
+    double classMajorTime = getTimeSeconds() - start;
+
+    start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        sink = predictNaiveBayes(&model, &testHOG.features[i * testHOG.numFeatures]);
+    }
+    double featureMajorTime = getTimeSeconds() - start;
+    (void)sink;
+
+    for (uint32_t i = 0; i < n; i++) {
+        double *features = &testHOG.features[i * testHOG.numFeatures];
+        uint8_t prediction = predictNaiveBayes(&model, features);
+        agree += legacyPredict(&model, classPrior, featureProb, features) == prediction &&
+                 classMajorPredict(&model, features) == prediction;
+    }
+
+    printf("\nScoring %u images, %d classes x %u features:\n", n, model.numClasses, model.numFeatures);
+    printf("  log() per term:             %8.2f us/image\n", 1e6 * legacyTime / n);
+    printf("  class-major log tables:     %8.2f us/image  (%.1fx)\n",
+           1e6 * classMajorTime / n, legacyTime / classMajorTime);
+    printf("  feature-major (predict):    %8.2f us/image  (%.1fx)\n",
+           1e6 * featureMajorTime / n, legacyTime / featureMajorTime);
+    printf("  Predictions agreeing:       %u/%u\n", agree, n);
+
+    free(classPrior);
+    free(featureProb);
+    freeMNISTDataset(&testDataset);
+    freeHOGFeatures(&testHOG);
+    freeNaiveBayes(&model);
+    return 0;
+}
+
+// Double-precision scoring against the int16 fixed-point tables on the test
+// set: table size, time, top-1 agreement and accuracy of both
+static int benchQuantized(const char *modelFile) {
+    MNISTDataset testDataset;
+    HOGFeatures testHOG;
+    NaiveBayesModel model;
+    NaiveBayesQuantized quantized;
+
+    if (!getModel(modelFile, &model)) {
+        return 1;
+    }
+    if (!loadFeatures(TEST_IMAGES, TEST_LABELS, modelFile != NULL, &testDataset, &testHOG)) {
+        freeNaiveBayes(&model);
+        return 1;
+    }
+
+    int ok = quantizeNaiveBayes(&quantized, &model);
+    uint32_t n = testHOG.numImages;
+    uint32_t numFeatures = model.numFeatures;
+    uint8_t *bins = (uint8_t*)malloc((size_t)n * numFeatures);
+    uint8_t *full = (uint8_t*)malloc(n);
+    uint8_t *fixed = (uint8_t*)malloc(n);
+    if (!ok || bins == NULL || full == NULL || fixed == NULL) {
+        printf("Failed to allocate memory for the quantization benchmark\n");
+        if (ok) {
+            freeNaiveBayesQuantized(&quantized);
+        }
+        free(bins);
+        free(full);
+        free(fixed);
+        freeMNISTDataset(&testDataset);
+        freeHOGFeatures(&testHOG);
+        freeNaiveBayes(&model);
+        return 1;
+    }
+    for (size_t i = 0; i < (size_t)n * numFeatures; i++) {
+        bins[i] = (uint8_t)hogValueBin(testHOG.features[i], model.numBins);
+    }
+
+    double start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        full[i] = scoreNaiveBayesBins(&model, &bins[(size_t)i * numFeatures], NULL);
+    }
+    double fullTime = getTimeSeconds() - start;
+
+    start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        fixed[i] = scoreNaiveBayesQuantized(&quantized, &bins[(size_t)i * numFeatures], NULL);
+    }
+    double fixedTime = getTimeSeconds() - start;
+
+    uint32_t agree = 0, fullCorrect = 0, fixedCorrect = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        agree += full[i] == fixed[i];
+        fullCorrect += full[i] == testHOG.labels[i];
+        fixedCorrect += fixed[i] == testHOG.labels[i];
+    }
+
+    size_t doubleBytes = (size_t)numFeatures * model.numBins * model.classStride * sizeof(double);
+    size_t fixedBytes = (size_t)numFeatures * quantized.numBins * quantized.classStride * sizeof(int16_t);
+    printf("\nFixed-point scoring, %u images, %d classes x %u features (scale %.1f per nat):\n",
+           n, model.numClasses, numFeatures, quantized.scale);
+    printf("  feature-major table:        %8.1f KB double, %.1f KB int16\n", doubleBytes / 1024.0, fixedBytes / 1024.0);
+    printf("  double, double sums:        %8.2f us/image  accuracy %.2f%%\n",
+           1e6 * fullTime / n, 100.0 * fullCorrect / n);
+    printf("  int16, int32 sums:          %8.2f us/image  accuracy %.2f%%  (%.1fx)\n",
+           1e6 * fixedTime / n, 100.0 * fixedCorrect / n, fullTime / fixedTime);
+    printf("  Top-1 agreement:            %u/%u (%.3f%%)\n", agree, n, 100.0 * agree / n);
+
+    freeNaiveBayesQuantized(&quantized);
+    free(bins);
+    free(full);
+    free(fixed);
+    freeMNISTDataset(&testDataset);
+    freeHOGFeatures(&testHOG);
+    freeNaiveBayes(&model);
+    return 0;
+}
+
+// Brush stroke added to test image i by benchIncremental: a 3x3 dab at a
+// position that varies from image to image
+static void addTestStroke(uint8_t *image, uint32_t rows, uint32_t cols, uint32_t i) {
+    int cx = 1 + (int)(i * 7 % (cols - 2));
+    int cy = 1 + (int)(i * 13 % (rows - 2));
+    for (int y = cy - 1; y <= cy + 1; y++) {
+        for (int x = cx - 1; x <= cx + 1; x++) {
+            image[y * cols + x] = 255;
+        }
+    }
+}
+
+// Rescoring a test image after a brush stroke: full HOG and scoring
+// against recomputing only the changed cells and rescoring only the
+// changed features, checking both give the same features and predictions
+static int benchIncremental(const char *modelFile) {
+    MNISTDataset testDataset;
+    HOGFeatures testHOG;
+    NaiveBayesModel model;
+
+    if (!getModel(modelFile, &model)) {
+        return 1;
+    }
+    if (!loadFeatures(TEST_IMAGES, TEST_LABELS, modelFile != NULL, &testDataset, &testHOG)) {
+        freeNaiveBayes(&model);
+        return 1;
+    }
+
+    uint32_t n = testHOG.numImages;
+    uint32_t numFeatures = model.numFeatures;
+    uint32_t imageSize = testDataset.imageSize;
+    int numCells = (testDataset.rows / CELL_SIZE) * (testDataset.cols / CELL_SIZE);
+    uint8_t *stroked = (uint8_t*)malloc((size_t)n * imageSize);
+    uint8_t *oldBins = (uint8_t*)malloc((size_t)n * numFeatures);
+    uint8_t *newBins = (uint8_t*)malloc((size_t)n * numFeatures);
+    double *oldScores = (double*)malloc((size_t)n * model.numClasses * sizeof(double));
+    double *scores = (double*)malloc((size_t)n * model.numClasses * sizeof(double));
+    uint8_t *fullPredictions = (uint8_t*)malloc(n);
+    if (stroked == NULL || oldBins == NULL || newBins == NULL || oldScores == NULL ||
+        scores == NULL || fullPredictions == NULL) {
+        printf("Failed to allocate memory for the incremental benchmark\n");
+        free(stroked);
+        free(oldBins);
+        free(newBins);
+        free(oldScores);
+        free(scores);
+        free(fullPredictions);
+        freeMNISTDataset(&testDataset);
+        freeHOGFeatures(&testHOG);
+        freeNaiveBayes(&model);
+        return 1;
+    }
+
+    // State before the stroke: features (in testHOG), bins and scores of every image
+    memcpy(stroked, testDataset.images, (size_t)n * imageSize);
+    for (uint32_t i = 0; i < n; i++) {
+        addTestStroke(&stroked[(size_t)i * imageSize], testDataset.rows, testDataset.cols, i);
+        for (uint32_t f = 0; f < numFeatures; f++) {
+            oldBins[(size_t)i * numFeatures + f] =
+                (uint8_t)hogValueBin(testHOG.features[(size_t)i * numFeatures + f], model.numBins);
+        }
+        scoreNaiveBayesBins(&model, &oldBins[(size_t)i * numFeatures], &oldScores[(size_t)i * model.numClasses]);
+    }
+    memcpy(scores, oldScores, (size_t)n * model.numClasses * sizeof(double));
+
+    double features[numFeatures];
+    uint8_t bins[numFeatures];
+    double start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        computeHOGImage(&stroked[(size_t)i * imageSize], testDataset.rows, testDataset.cols,
+                        CELL_SIZE, NUM_BINS, features);
+        for (uint32_t f = 0; f < numFeatures; f++) {
+            bins[f] = (uint8_t)hogValueBin(features[f], model.numBins);
+        }
+        fullPredictions[i] = scoreNaiveBayesBins(&model, bins, NULL);
+    }
+    double fullTime = getTimeSeconds() - start;
+
+    // Bring each image's features, bins and scores up to date in place
+    uint64_t totalDirty = 0;
+    uint8_t dirtyCells[numCells];
+    start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        double *imageFeatures = &testHOG.features[(size_t)i * numFeatures];
+        uint8_t *imageBins = &newBins[(size_t)i * numFeatures];
+        totalDirty += markChangedHOGCells(&testDataset.images[(size_t)i * imageSize], &stroked[(size_t)i * imageSize],
+                                          testDataset.rows, testDataset.cols, CELL_SIZE, dirtyCells);
+        computeHOGCells(&stroked[(size_t)i * imageSize], testDataset.rows, testDataset.cols,
+                        CELL_SIZE, NUM_BINS, dirtyCells, imageFeatures);
+        memcpy(imageBins, &oldBins[(size_t)i * numFeatures], numFeatures);
+        for (int cell = 0; cell < numCells; cell++) {
+            if (dirtyCells[cell]) {
+                for (uint32_t f = cell * NUM_BINS; f < (uint32_t)(cell + 1) * NUM_BINS; f++) {
+                    imageBins[f] = (uint8_t)hogValueBin(imageFeatures[f], model.numBins);
+                }
+            }
+        }
+        rescoreNaiveBayesBins(&model, &oldBins[(size_t)i * numFeatures], imageBins,
+                              &scores[(size_t)i * model.numClasses]);
+    }
+    double incrementalTime = getTimeSeconds() - start;
+
+    // The score update alone, from the same starting scores
+    memcpy(scores, oldScores, (size_t)n * model.numClasses * sizeof(double));
+    uint32_t agree = 0;
+    start = getTimeSeconds();
+    for (uint32_t i = 0; i < n; i++) {
+        agree += rescoreNaiveBayesBins(&model, &oldBins[(size_t)i * numFeatures], &newBins[(size_t)i * numFeatures],
+                                       &scores[(size_t)i * model.numClasses]) == fullPredictions[i];
+    }
+    double rescoreTime = getTimeSeconds() - start;
+
+    // Updated features must be exactly the ones of the stroked images
+    uint32_t featureMismatches = 0;
+    double maxScoreError = 0.0;
+    double fresh[model.numClasses];
+    for (uint32_t i = 0; i < n; i++) {
+        computeHOGImage(&stroked[(size_t)i * imageSize], testDataset.rows, testDataset.cols,
+                        CELL_SIZE, NUM_BINS, features);
+        featureMismatches += memcmp(features, &testHOG.features[(size_t)i * numFeatures],
+                                    numFeatures * sizeof(double)) != 0;
+        scoreNaiveBayesBins(&model, &newBins[(size_t)i * numFeatures], fresh);
+        for (int c = 0; c < model.numClasses; c++) {
+            double error = fabs(fresh[c] - scores[(size_t)i * model.numClasses + c]);
+            maxScoreError = error > maxScoreError ? error : maxScoreError;
+        }
+    }
+
+    printf("\nRescoring after a 3x3 stroke, %u images, %d cells:\n", n, numCells);
+    printf("  full HOG + scoring:         %8.3f us/stroke\n", 1e6 * fullTime / n);
+    printf("  changed cells + rescoring:  %8.3f us/stroke  (%.1fx), %.1f cells recomputed on average\n",
+           1e6 * incrementalTime / n, fullTime / incrementalTime, (double)totalDirty / n);
+    printf("  score update alone:         %8.3f us/stroke\n", 1e6 * rescoreTime / n);
+    printf("  Features differing:         %u/%u images\n", featureMismatches, n);
+    printf("  Predictions agreeing:       %u/%u (largest score difference %.3g)\n", agree, n, maxScoreError);
+
+    free(stroked);
+    free(oldBins);
+    free(newBins);
+    free(oldScores);
+    free(scores);
+    free(fullPredictions);
+    freeMNISTDataset(&testDataset);
+    freeHOGFeatures(&testHOG);
+    freeNaiveBayes(&model);
+    return 0;
+}
+
+// HOG extraction time on the training set at increasing thread counts,
+// checking every run against the single-threaded output
+static int benchHOGScaling(void) {
+    static const int threadCounts[] = {1, 2, 4, 8, 16};
+    int numRuns = sizeof(threadCounts) / sizeof(threadCounts[0]);
+    MNISTDataset dataset;
+
+    if (!loadMNISTDataset(TRAIN_IMAGES, TRAIN_LABELS, &dataset)) {
+        printf("Failed to load %s. Check that files exist in the data/ directory.\n", TRAIN_IMAGES);
+        return 1;
+    }
+
+    HOGFeatures reference;
+    double times[numRuns];
+    int identical[numRuns];
+
+    for (int r = 0; r < numRuns; r++) {
+        HOGFeatures hogFeatures;
+        hogFeatures.numImages = dataset.numImages;
+        hogFeatures.numFeatures = (dataset.rows/CELL_SIZE) * (dataset.cols/CELL_SIZE) * NUM_BINS;
+
+        double start = getTimeSeconds();
+        extractHOGFeaturesParallel(&dataset, &hogFeatures, CELL_SIZE, NUM_BINS, threadCounts[r]);
+        times[r] = getTimeSeconds() - start;
+
+        if (r == 0) {
+            reference = hogFeatures;
+            identical[r] = 1;
+        } else {
+            identical[r] = memcmp(reference.features, hogFeatures.features,
+                                  (size_t)hogFeatures.numImages * hogFeatures.numFeatures * sizeof(double)) == 0;
+            freeHOGFeatures(&hogFeatures);
+        }
+    }
+
+    printf("\nHOG extraction, %u images (%d CPUs online):\n", dataset.numImages, getDefaultThreadCount());
+    printf("Threads\tSeconds\tImages/sec\tSpeedup\tIdentical\n");
+    for (int r = 0; r < numRuns; r++) {
+        printf("%d\t%.3f\t%.0f\t\t%.2fx\t%s\n", threadCounts[r], times[r],
+               dataset.numImages / times[r], times[0] / times[r], identical[r] ? "yes" : "NO");
+    }
+
+    freeHOGFeatures(&reference);
+    freeMNISTDataset(&dataset);
+    return 0;
+}
+
+// Naive Bayes training time on the training set's binned features at
+// increasing thread counts, checking every model against the 1-thread one
+static int benchTrainingScaling(void) {
+    static const int threadCounts[] = {1, 2, 4, 8, 16};
+    int numRuns = sizeof(threadCounts) / sizeof(threadCounts[0]);
+    MNISTDataset dataset;
+    HOGFeatures hogFeatures;
+
+    if (!loadMNISTDataset(TRAIN_IMAGES, TRAIN_LABELS, &dataset)) {
+        printf("Failed to load %s. Check that files exist in the data/ directory.\n", TRAIN_IMAGES);
+        return 1;
+    }
+    for (uint32_t i = 0; i < dataset.numImages; i++) {
+        if (dataset.labels[i] > 0) {
+            dataset.labels[i] -= 1;
+        }
+    }
+    hogFeatures.numImages = dataset.numImages;
+    hogFeatures.numFeatures = (dataset.rows/CELL_SIZE) * (dataset.cols/CELL_SIZE) * NUM_BINS;
+    extractHOGFeaturesAs(&dataset, &hogFeatures, CELL_SIZE, NUM_BINS, HOG_STORAGE_BINNED, MODEL_BINS, 0);
+
+    NaiveBayesModel reference;
+    double times[numRuns];
+    int identical[numRuns];
+
+    for (int r = 0; r < numRuns; r++) {
+        NaiveBayesModel model;
+        if (!initNaiveBayes(&model, NUM_CLASSES, hogFeatures.numFeatures, MODEL_BINS, 1.0)) {
+            freeHOGFeatures(&hogFeatures);
+            freeMNISTDataset(&dataset);
+            return 1;
+        }
+
+        setDefaultThreadCount(threadCounts[r]);
+        double start = getTimeSeconds();
+        trainNaiveBayes(&model, &hogFeatures);
+        times[r] = getTimeSeconds() - start;
+
+        if (r == 0) {
+            reference = model;
+            identical[r] = 1;
+        } else {
+            identical[r] = memcmp(reference.storage, model.storage, model.storageSize) == 0;
+            freeNaiveBayes(&model);
+        }
+    }
+    setDefaultThreadCount(0);
+
+    printf("\nNaive Bayes training, %u images (%d CPUs online):\n", dataset.numImages, getDefaultThreadCount());
+    printf("Threads\tSeconds\tImages/sec\tSpeedup\tIdentical\n");
+    for (int r = 0; r < numRuns; r++) {
+        printf("%d\t%.3f\t%.0f\t\t%.2fx\t%s\n", threadCounts[r], times[r],
+               dataset.numImages / times[r], times[0] / times[r], identical[r] ? "yes" : "NO");
+    }
+
+    freeNaiveBayes(&reference);
+    freeHOGFeatures(&hogFeatures);
+    freeMNISTDataset(&dataset);
+    return 0;
+}
+
+// Cost of adding labelled batches with updateNaiveBayes compared with
+// retraining from scratch, checking the updated model matches the retrained one
+static int benchUpdate(void) {
+    static const uint32_t batchSizes[] = {1, 100, 10000};
+    int numSizes = sizeof(batchSizes) / sizeof(batchSizes[0]);
+    MNISTDataset dataset;
+    HOGFeatures hogFeatures;
+
+    if (!loadFeatures(TRAIN_IMAGES, TRAIN_LABELS, 0, &dataset, &hogFeatures)) {
+        return 1;
+    }
+
+    NaiveBayesModel full;
+    if (!initNaiveBayes(&full, NUM_CLASSES, hogFeatures.numFeatures, MODEL_BINS, 1.0)) {
+        freeMNISTDataset(&dataset);
+        freeHOGFeatures(&hogFeatures);
+        return 1;
+    }
+    double start = getTimeSeconds();
+    trainNaiveBayes(&full, &hogFeatures);
+    double retrainTime = getTimeSeconds() - start;
+
+    printf("\nModel refresh, %u training images:\n", hogFeatures.numImages);
+    printf("  full retrain:              %10.3f ms\n", 1e3 * retrainTime);
+
+    for (int s = 0; s < numSizes; s++) {
+        // Train on everything but the last batch, then add it
+        uint32_t batch = batchSizes[s];
+        HOGFeatures head = hogFeatures;
+        head.numImages = hogFeatures.numImages - batch;
+
+        NaiveBayesModel model;
+        if (!initNaiveBayes(&model, NUM_CLASSES, hogFeatures.numFeatures, MODEL_BINS, 1.0)) {
+            break;
+        }
+        trainNaiveBayes(&model, &head);
+
+        start = getTimeSeconds();
+        updateNaiveBayes(&model, &hogFeatures.features[(size_t)head.numImages * hogFeatures.numFeatures],
+                         &hogFeatures.labels[head.numImages], batch);
+        double elapsed = getTimeSeconds() - start;
+
+        int identical = memcmp(full.storage, model.storage, full.storageSize) == 0;
+        printf("  update, batch of %-8u %10.3f ms  (%.1fx faster)  %s\n", batch, 1e3 * elapsed,
+               retrainTime / elapsed, identical ? "identical to retrain" : "DIFFERS from retrain");
+        freeNaiveBayes(&model);
+    }
+
+    freeNaiveBayes(&full);
+    freeHOGFeatures(&hogFeatures);
+    freeMNISTDataset(&dataset);
+    return 0;
+}
+
+// Single-threaded per-image HOG time for each gradient method on the test set
+static int benchGradient(void) {
+    static const HOGGradientMethod methods[] = {HOG_GRADIENT_DIRECT, HOG_GRADIENT_LUT, HOG_GRADIENT_SIMD};
+    static const char *names[] = {"direct sqrt/atan2", "lookup tables", "SIMD planes + LUT"};
+    int numMethods = sizeof(methods) / sizeof(methods[0]);
+    MNISTDataset dataset;
+
+    if (!loadMNISTDataset(TEST_IMAGES, TEST_LABELS, &dataset)) {
+        printf("Failed to load %s. Check that files exist in the data/ directory.\n", TEST_IMAGES);
+        return 1;
+    }
+
+    uint32_t numFeatures = (dataset.rows/CELL_SIZE) * (dataset.cols/CELL_SIZE) * NUM_BINS;
+    double *reference = (double*)malloc((size_t)dataset.numImages * numFeatures * sizeof(double));
+    double *features = (double*)malloc(numFeatures * sizeof(double));
+    if (reference == NULL || features == NULL) {
+        printf("Failed to allocate memory for HOG features\n");
+        free(reference);
+        free(features);
+        freeMNISTDataset(&dataset);
+        return 1;
+    }
+
+    printf("\nHOG extraction per image, %u images, 1 thread:\n", dataset.numImages);
+    double baseTime = 0;
+    for (int m = 0; m < numMethods; m++) {
+        setHOGGradientMethod(methods[m]);
+
+        // Warm up once so table construction isn't timed
+        computeHOGImage(dataset.images, dataset.rows, dataset.cols, CELL_SIZE, NUM_BINS, features);
+
+        uint32_t mismatches = 0;
+        double start = getTimeSeconds();
+        for (uint32_t i = 0; i < dataset.numImages; i++) {
+            double *out = (m == 0) ? &reference[(size_t)i * numFeatures] : features;
+            computeHOGImage(&dataset.images[i * dataset.imageSize], dataset.rows, dataset.cols,
+                            CELL_SIZE, NUM_BINS, out);
+            if (m > 0) {
+                mismatches += memcmp(out, &reference[(size_t)i * numFeatures],
+                                     numFeatures * sizeof(double)) != 0;
+            }
+        }
+        double elapsed = getTimeSeconds() - start;
+        if (m == 0) {
+            baseTime = elapsed;
+        }
+
+        printf("  %-20s %8.2f us/image  (%.1fx)  %u images differ\n", names[m],
+               1e6 * elapsed / dataset.numImages, baseTime / elapsed, mismatches);
+    }
+
+    free(reference);
+    free(features);
+    freeMNISTDataset(&dataset);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "scoring") == 0) {
+        return benchScoring(argc == 3 ? argv[2] : NULL);
+    }
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "quantized") == 0) {
+        return benchQuantized(argc == 3 ? argv[2] : NULL);
+    }
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "incremental") == 0) {
+        return benchIncremental(argc == 3 ? argv[2] : NULL);
+    }
+    if (argc == 2 && strcmp(argv[1], "hog") == 0) {
+        return benchHOGScaling();
+    }
+    if (argc == 2 && strcmp(argv[1], "gradient") == 0) {
+        return benchGradient();
+    }
+    if (argc == 2 && strcmp(argv[1], "training") == 0) {
+        return benchTrainingScaling();
+    }
+    if (argc == 2 && strcmp(argv[1], "update") == 0) {
+        return benchUpdate();
+    }
+
+    printf("Usage: %s scoring [MODEL_FILE]\n", argv[0]);
+    printf("       %s quantized [MODEL_FILE]\n", argv[0]);
+    printf("       %s incremental [MODEL_FILE]\n", argv[0]);
+    printf("       %s hog\n", argv[0]);
+    printf("       %s gradient\n", argv[0]);
+    printf("       %s training\n", argv[0]);
+    printf("       %s update\n", argv[0]);
+    return 1;
+}
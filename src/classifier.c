@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "classifier.h"
+#include "hog.h"
+
+// Incremental rescores between two full scorings, bounding the rounding
+// the score updates build up
+#define FULL_RESCORE_INTERVAL 64
+
+static size_t alignTableBytes(size_t bytes) {
+    return (bytes + NB_TABLE_ALIGN - 1) / NB_TABLE_ALIGN * NB_TABLE_ALIGN;
+}
+
+bool initClassifierScratch(ClassifierScratch *scratch, const NaiveBayesModel *model,
+                           uint32_t rows, uint32_t cols, int cellSize, int hogBins) {
+    memset(scratch, 0, sizeof(ClassifierScratch));
+    if (cellSize <= 0 || rows % cellSize != 0 || cols % cellSize != 0) {
+        printf("Image size %ux%u is not a multiple of the cell size %d\n", rows, cols, cellSize);
+        return false;
+    }
+
+    uint32_t numCells = (rows / cellSize) * (cols / cellSize);
+    if ((uint64_t)numCells * hogBins != model->numFeatures) {
+        printf("ERROR: Feature dimension mismatch! Expected: %u, Got: %u\n",
+               model->numFeatures, numCells * hogBins);
+        printf("This is likely due to a cell size mismatch between training and prediction.\n");
+        return false;
+    }
+
+    scratch->rows = rows;
+    scratch->cols = cols;
+    scratch->cellSize = cellSize;
+    scratch->hogBins = hogBins;
+    scratch->numClasses = model->numClasses;
+    scratch->numFeatures = model->numFeatures;
+    scratch->numCells = numCells;
+    scratch->preprocess = false;
+    scratch->incremental = false;
+    scratch->temperature = 1.0;
+
+    size_t imageBytes = alignTableBytes((size_t)rows * cols);
+    size_t cellBytes = alignTableBytes(numCells);
+    size_t featureBytes = alignTableBytes((size_t)model->numFeatures * sizeof(double));
+    size_t binBytes = alignTableBytes(model->numFeatures);
+    size_t classBytes = alignTableBytes((size_t)model->classStride * sizeof(double));
+    scratch->storageSize = 2 * imageBytes + cellBytes + featureBytes + 2 * binBytes + 2 * classBytes;
+    if (posix_memalign(&scratch->storage, NB_TABLE_ALIGN, scratch->storageSize) != 0) {
+        printf("Failed to allocate classifier scratch memory\n");
+        scratch->storage = NULL;
+        return false;
+    }
+    memset(scratch->storage, 0, scratch->storageSize);
+
+    uint8_t *block = (uint8_t*)scratch->storage;
+    scratch->image = block;
+    block += imageBytes;
+    scratch->lastImage = block;
+    block += imageBytes;
+    scratch->dirtyCells = block;
+    block += cellBytes;
+    scratch->features = (double*)block;
+    block += featureBytes;
+    scratch->bins = block;
+    block += binBytes;
+    scratch->lastBins = block;
+    block += binBytes;
+    scratch->logProbs = (double*)block;
+    block += classBytes;
+    scratch->confidence = (double*)block;
+
+    // The gradient tables must exist before several threads extract HOG features
+    prepareHOGExtraction(hogBins);
+    return true;
+}
+
+// Bring scratch->features, bins and logProbs up to date with scratch->image.
+// Only the HOG cells whose pixels (or their neighbours) changed since the
+// previous image are recomputed, and only the features whose bin moved are
+// rescored. Returns the number of cells recomputed.
+static int updateImageScores(const NaiveBayesModel *model, ClassifierScratch *scratch) {
+    int numDirty = (int)scratch->numCells;
+    if (scratch->haveLast) {
+        numDirty = markChangedHOGCells(scratch->lastImage, scratch->image, scratch->rows, scratch->cols,
+                                       scratch->cellSize, scratch->dirtyCells);
+        if (numDirty == 0) {
+            return 0;
+        }
+    } else {
+        memset(scratch->dirtyCells, 1, scratch->numCells);
+    }
+    computeHOGCells(scratch->image, scratch->rows, scratch->cols, scratch->cellSize, scratch->hogBins,
+                    scratch->dirtyCells, scratch->features);
+
+    memcpy(scratch->lastBins, scratch->bins, scratch->numFeatures);
+    for (uint32_t cell = 0; cell < scratch->numCells; cell++) {
+        if (scratch->dirtyCells[cell]) {
+            uint32_t end = (cell + 1) * scratch->hogBins;
+            for (uint32_t f = cell * scratch->hogBins; f < end; f++) {
+                scratch->bins[f] = (uint8_t)hogValueBin(scratch->features[f], model->numBins);
+            }
+        }
+    }
+
+    if (scratch->haveLast && scratch->rescoresSinceFull < FULL_RESCORE_INTERVAL) {
+        rescoreNaiveBayesBins(model, scratch->lastBins, scratch->bins, scratch->logProbs);
+        scratch->rescoresSinceFull++;
+    } else {
+        scoreNaiveBayesBins(model, scratch->bins, scratch->logProbs);
+        scratch->rescoresSinceFull = 0;
+    }
+    return numDirty;
+}
+
+bool classifyImage(const NaiveBayesModel *model, const uint8_t *pixels,
+                   ClassifierScratch *scratch, ClassifierResult *result) {
+    if (scratch->storage == NULL || model->numClasses != scratch->numClasses ||
+        model->numFeatures != scratch->numFeatures) {
+        printf("Classifier scratch does not match the model\n");
+        return false;
+    }
+    if (scratch->preprocess && (scratch->rows != 28 || scratch->cols != 28)) {
+        printf("Preprocessing needs a 28x28 image, got %ux%u\n", scratch->rows, scratch->cols);
+        return false;
+    }
+
+    size_t imageSize = (size_t)scratch->rows * scratch->cols;
+    if (scratch->incremental && scratch->haveLast) {
+        memcpy(scratch->lastImage, scratch->image, imageSize);
+    }
+    if (scratch->preprocess) {
+        preprocessCanvas(pixels, scratch->image);
+    } else {
+        memcpy(scratch->image, pixels, imageSize);
+    }
+
+    if (scratch->incremental) {
+        result->cellsRecomputed = updateImageScores(model, scratch);
+        scratch->haveLast = true;
+    } else {
+        computeHOGImage(scratch->image, scratch->rows, scratch->cols, scratch->cellSize,
+                        scratch->hogBins, scratch->features);
+        for (uint32_t f = 0; f < scratch->numFeatures; f++) {
+            scratch->bins[f] = (uint8_t)hogValueBin(scratch->features[f], model->numBins);
+        }
+        scoreNaiveBayesBins(model, scratch->bins, scratch->logProbs);
+        result->cellsRecomputed = (int)scratch->numCells;
+        scratch->haveLast = false;
+    }
+
+    // Same choice as scoreNaiveBayesBins: the first of the highest scores
+    const double *logProbs = scratch->logProbs;
+    int bestClass = 0;
+    for (int c = 1; c < scratch->numClasses; c++) {
+        if (logProbs[c] > logProbs[bestClass]) {
+            bestClass = c;
+        }
+    }
+    result->prediction = (uint8_t)bestClass;
+
+    // Softmax with temperature, shifted by the best score so exp can't overflow
+    double temperature = scratch->temperature > 0 ? scratch->temperature : 1.0;
+    double totalProb = 0.0;
+    for (int c = 0; c < scratch->numClasses; c++) {
+        scratch->confidence[c] = exp((logProbs[c] - logProbs[bestClass]) / temperature);
+        totalProb += scratch->confidence[c];
+    }
+    for (int c = 0; c < scratch->numClasses; c++) {
+        scratch->confidence[c] /= totalProb;
+    }
+
+    // Top k by insertion into the short sorted list; equal confidences keep class order
+    result->numTop = scratch->numClasses < CLASSIFIER_TOP_K ? scratch->numClasses : CLASSIFIER_TOP_K;
+    int found = 0;
+    for (int c = 0; c < scratch->numClasses; c++) {
+        double conf = scratch->confidence[c];
+        if (found == result->numTop && conf <= result->topConfidences[found - 1]) {
+            continue;
+        }
+        int pos = found < result->numTop ? found++ : found - 1;
+        while (pos > 0 && result->topConfidences[pos - 1] < conf) {
+            result->topClasses[pos] = result->topClasses[pos - 1];
+            result->topConfidences[pos] = result->topConfidences[pos - 1];
+            pos--;
+        }
+        result->topClasses[pos] = (uint8_t)c;
+        result->topConfidences[pos] = conf;
+    }
+    return true;
+}
+
+void freeClassifierScratch(ClassifierScratch *scratch) {
+    free(scratch->storage);
+    memset(scratch, 0, sizeof(ClassifierScratch));
+}
+
+void preprocessCanvas(const uint8_t *canvas, uint8_t *processedCanvas) {
+    // Step 1: Find the bounding box of the drawn character
+    int minX = 28, minY = 28, maxX = 0, maxY = 0;
+    int hasContent = 0;
+
+    for (int y = 0; y < 28; y++) {
+        for (int x = 0; x < 28; x++) {
+            if (canvas[y * 28 + x] > 50) {
+                hasContent = 1;
+                if (x < minX) minX = x;
+                if (y < minY) minY = y;
+                if (x > maxX) maxX = x;
+                if (y > maxY) maxY = y;
+            }
+        }
+    }
+
+    // If no content, return empty canvas
+    if (!hasContent) {
+        memset(processedCanvas, 0, 28 * 28);
+        return;
+    }
+
+    // Step 2: Initialize processed canvas to zeros
+    memset(processedCanvas, 0, 28 * 28);
+
+    // Step 3: Calculate dimensions and center offset
+    int width = maxX - minX + 1;
+    int height = maxY - minY + 1;
+    
+    // Use a more conservative padding (10% instead of 20%)
+    int paddingX = width / 10;
+    int paddingY = height / 10;
+    
+    // Calculate new dimensions with padding
+    int newWidth = width + 2 * paddingX;
+    int newHeight = height + 2 * paddingY;
+    
+    // Determine scaling factor to fit in 28x28 while preserving aspect ratio
+    float scaleX = 28.0f / newWidth;
+    float scaleY = 28.0f / newHeight;
+    float scale = (scaleX < scaleY) ? scaleX : scaleY;
+    
+    // Calculate the final dimensions after scaling
+    int finalWidth = (int)(width * scale);
+    int finalHeight = (int)(height * scale);
+    
+    // Calculate centering offsets
+    int offsetX = (28 - finalWidth) / 2;
+    int offsetY = (28 - finalHeight) / 2;
+    
+    // Ensure offsets are not negative
+    offsetX = (offsetX < 0) ? 0 : offsetX;
+    offsetY = (offsetY < 0) ? 0 : offsetY;
+
+    // Step 4: Scale and center the content with proper aspect ratio
+    for (int y = 0; y < finalHeight; y++) {
+        for (int x = 0; x < finalWidth; x++) {
+            // Map the destination (x,y) back to source coordinates
+            int srcX = minX + (int)(x / scale);
+            int srcY = minY + (int)(y / scale);
+            
+            // Ensure source coordinates are in bounds
+            if (srcX >= 0 && srcX < 28 && srcY >= 0 && srcY < 28) {
+                // Copy pixel to the centered position in the processed canvas
+                processedCanvas[(offsetY + y) * 28 + (offsetX + x)] = canvas[srcY * 28 + srcX];
+            }
+        }
+    }
+
+    // Step 5: Apply thresholding and normalization
+    for (int i = 0; i < 28 * 28; i++) {
+        // Binary thresholding
+        processedCanvas[i] = (processedCanvas[i] > 30) ? 255 : 0;
+    }
+}
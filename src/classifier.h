@@ -0,0 +1,71 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "naive_bayes.h"
+
+// Classes reported in a ClassifierResult, best first
+#define CLASSIFIER_TOP_K 5
+
+// Working memory for classifyImage, allocated once for a model and image
+// size so classifying never touches the heap. A scratch serves one caller
+// at a time; threads classifying with the same model each use their own.
+typedef struct {
+    uint32_t rows;
+    uint32_t cols;
+    int cellSize;          // HOG parameters the model was trained with
+    int hogBins;
+    int numClasses;
+    uint32_t numFeatures;
+    uint32_t numCells;
+
+    // Options, set after initClassifierScratch
+    bool preprocess;       // Crop, scale and center a drawing first (28x28 canvases only)
+    bool incremental;      // Recompute only what changed since the previous image
+    double temperature;    // Softmax temperature of the confidences (1 = plain softmax)
+
+    bool haveLast;         // image, features, bins and logProbs hold the previous image
+    int rescoresSinceFull; // Incremental rescores since the last full scoring
+
+    // Buffers inside storage, each aligned to NB_TABLE_ALIGN
+    uint8_t *image;        // Image as classified (after preprocessing), rows*cols
+    uint8_t *lastImage;    // Previous image, for incremental updates
+    uint8_t *dirtyCells;   // numCells flags from markChangedHOGCells
+    double *features;      // HOG features of image
+    uint8_t *bins;         // features binned for the model
+    uint8_t *lastBins;     // Bins of the previous image
+    double *logProbs;      // Class scores, numClasses
+    double *confidence;    // Softmax of logProbs at the given temperature
+    void *storage;
+    size_t storageSize;
+} ClassifierScratch;
+
+typedef struct {
+    uint8_t prediction;
+    int numTop;                               // min(CLASSIFIER_TOP_K, numClasses)
+    uint8_t topClasses[CLASSIFIER_TOP_K];     // Best first; ties go to the lower class
+    double topConfidences[CLASSIFIER_TOP_K];
+    int cellsRecomputed;                      // HOG cells computed for this image
+} ClassifierResult;
+
+// Allocate scratch memory for classifying rows x cols images with model,
+// whose features come from HOG with cellSize and hogBins
+bool initClassifierScratch(ClassifierScratch *scratch, const NaiveBayesModel *model,
+                           uint32_t rows, uint32_t cols, int cellSize, int hogBins);
+
+// Preprocess (if enabled), extract HOG features and score one image, all
+// inside the scratch memory. The full scores and confidences stay in
+// scratch->logProbs and scratch->confidence until the next call. Reentrant
+// as long as concurrent calls use different scratches. Fails if the scratch
+// was set up for a model of another shape.
+bool classifyImage(const NaiveBayesModel *model, const uint8_t *pixels,
+                   ClassifierScratch *scratch, ClassifierResult *result);
+
+void freeClassifierScratch(ClassifierScratch *scratch);
+
+// Crop a 28x28 drawing to its bounding box, scale it to fill the canvas
+// keeping its aspect ratio, center it and threshold it to black and white
+void preprocessCanvas(const uint8_t *canvas, uint8_t *processedCanvas);
+
+#endif // CLASSIFIER_H
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "feature_cache.h"
+
+_Static_assert(sizeof(HOGCacheHeader) == 128, "cached features must start aligned");
+
+// Multiply-xor hash with the FNV-1a constants. It folds in eight bytes per
+// step rather than one, so it is not FNV-1a itself.
+#define HASH_OFFSET 0xcbf29ce484222325ull
+#define HASH_PRIME 0x100000001b3ull
+
+static uint64_t hashWords(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t*)data;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * HASH_PRIME;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ bytes[i]) * HASH_PRIME;
+    }
+    return hash;
+}
+
+// Blocks of a file hashed into its sampleHash: the first one holds the IDX
+// header, the last ends at the end of the file and the rest are spread
+// evenly in between. Smaller files are hashed whole.
+#define SAMPLE_BLOCKS 16
+#define SAMPLE_BLOCK_BYTES 4096
+
+// Identify an IDX file the way the loader opens it: FILENAME, else FILENAME.gz
+static int identifyIDXFile(const char *filename, HOGCacheSource *source) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        char gzName[strlen(filename) + 4];
+        snprintf(gzName, sizeof(gzName), "%s.gz", filename);
+        fd = open(gzName, O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    memset(source, 0, sizeof(HOGCacheSource));
+    source->size = (uint64_t)st.st_size;
+    source->mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    source->device = (uint64_t)st.st_dev;
+    source->inode = (uint64_t)st.st_ino;
+
+    uint8_t block[SAMPLE_BLOCK_BYTES];
+    uint64_t hash = HASH_OFFSET;
+    int ok = 1;
+    if (source->size <= (uint64_t)SAMPLE_BLOCKS * SAMPLE_BLOCK_BYTES) {
+        ssize_t got;
+        while ((got = read(fd, block, sizeof(block))) > 0) {
+            hash = hashWords(hash, block, (size_t)got);
+        }
+        ok = got == 0;
+    } else {
+        uint64_t span = source->size - SAMPLE_BLOCK_BYTES;
+        for (int i = 0; i < SAMPLE_BLOCKS && ok; i++) {
+            off_t offset = (off_t)(span * i / (SAMPLE_BLOCKS - 1));
+            ok = pread(fd, block, sizeof(block), offset) == (ssize_t)sizeof(block);
+            hash = hashWords(hash, block, sizeof(block));
+        }
+    }
+    close(fd);
+    source->sampleHash = hash;
+    return ok;
+}
+
+int hogCacheKey(const char *imageFile, const char *labelFile, int cellSize, int numBins,
+                HOGStorage storage, int quantBins, uint32_t flags,
+                HOGCacheSource *imageSource, HOGCacheSource *labelSource, uint64_t *key) {
+    if (!identifyIDXFile(imageFile, imageSource) || !identifyIDXFile(labelFile, labelSource)) {
+        return 0;
+    }
+
+    int64_t params[] = {HOG_CACHE_VERSION, cellSize, numBins, (int64_t)storage, quantBins, (int64_t)flags};
+    uint64_t hash = hashWords(HASH_OFFSET, params, sizeof(params));
+    hash = hashWords(hash, imageSource, sizeof(HOGCacheSource));
+    *key = hashWords(hash, labelSource, sizeof(HOGCacheSource));
+    return 1;
+}
+
+// Bytes per feature value in each storage form
+static size_t storageValueSize(HOGStorage storage) {
+    return storage == HOG_STORAGE_DOUBLE ? sizeof(double) :
+           storage == HOG_STORAGE_FLOAT ? sizeof(float) : sizeof(uint8_t);
+}
+
+// Map a cache file and point hogFeatures into it. Returns 0 if the file is
+// missing or isn't a consistent cache for key and the given source files.
+static int mapHOGCache(const char *path, uint64_t key, const HOGCacheSource *imageSource,
+                       const HOGCacheSource *labelSource, HOGFeatures *hogFeatures,
+                       HOGStorage storage, int quantBins) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HOGCacheHeader)) {
+        close(fd);
+        return 0;
+    }
+
+    // Private writable pages, like a loaded array; edits never reach the file
+    void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    // The dataset isn't loaded, so its shape comes from the header, checked
+    // against the file size
+    const HOGCacheHeader *header = (const HOGCacheHeader*)mapping;
+    size_t valueBytes = (size_t)header->numImages * header->numFeatures * storageValueSize(storage);
+    size_t labelBytes = header->hasLabels ? header->numImages : 0;
+    if (header->magic != HOG_CACHE_MAGIC || header->version != HOG_CACHE_VERSION ||
+        header->key != key ||
+        memcmp(&header->images, imageSource, sizeof(HOGCacheSource)) != 0 ||
+        memcmp(&header->labels, labelSource, sizeof(HOGCacheSource)) != 0 ||
+        header->storage != (int32_t)storage ||
+        header->quantBins != quantBins || header->valueBytes != valueBytes ||
+        (size_t)st.st_size != sizeof(HOGCacheHeader) + valueBytes + labelBytes) {
+        printf("Ignoring stale HOG feature cache %s\n", path);
+        munmap(mapping, st.st_size);
+        return 0;
+    }
+
+    uint8_t *values = (uint8_t*)mapping + sizeof(HOGCacheHeader);
+    hogFeatures->numImages = header->numImages;
+    hogFeatures->numFeatures = header->numFeatures;
+    hogFeatures->features = storage == HOG_STORAGE_DOUBLE ? (double*)values : NULL;
+    hogFeatures->featuresFloat = storage == HOG_STORAGE_FLOAT ? (float*)values : NULL;
+    hogFeatures->bins = storage == HOG_STORAGE_BINNED ? values : NULL;
+    hogFeatures->labels = header->hasLabels ? values + valueBytes : NULL;
+    hogFeatures->storage = storage;
+    hogFeatures->quantBins = quantBins;
+    hogFeatures->mapping = mapping;
+    hogFeatures->mappingSize = st.st_size;
+
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    return 1;
+}
+
+// Write extracted features to path. Goes through a temporary file and a
+// rename, so a concurrent run never maps a half-written cache.
+static int writeHOGCache(const char *path, uint64_t key, const HOGCacheSource *imageSource,
+                         const HOGCacheSource *labelSource, const HOGFeatures *hogFeatures) {
+    char tmpPath[strlen(path) + 32];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *file = fopen(tmpPath, "wb");
+    if (file == NULL) {
+        perror("Error opening HOG feature cache for writing");
+        return 0;
+    }
+
+    const void *values = hogFeatures->storage == HOG_STORAGE_DOUBLE ? (const void*)hogFeatures->features :
+                         hogFeatures->storage == HOG_STORAGE_FLOAT ? (const void*)hogFeatures->featuresFloat :
+                         (const void*)hogFeatures->bins;
+
+    HOGCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HOG_CACHE_MAGIC;
+    header.version = HOG_CACHE_VERSION;
+    header.key = key;
+    header.images = *imageSource;
+    header.labels = *labelSource;
+    header.numImages = hogFeatures->numImages;
+    header.numFeatures = hogFeatures->numFeatures;
+    header.storage = hogFeatures->storage;
+    header.quantBins = hogFeatures->quantBins;
+    header.valueBytes = (size_t)hogFeatures->numImages * hogFeatures->numFeatures *
+                        storageValueSize(hogFeatures->storage);
+    header.hasLabels = hogFeatures->labels != NULL;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(values, 1, header.valueBytes, file) == header.valueBytes &&
+             (!header.hasLabels ||
+              fwrite(hogFeatures->labels, 1, hogFeatures->numImages, file) == hogFeatures->numImages);
+
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(tmpPath, path) != 0) {
+        printf("Failed to write HOG feature cache %s\n", path);
+        unlink(tmpPath);
+        return 0;
+    }
+    return 1;
+}
+
+int loadHOGFeaturesCached(const char *cacheDir, const char *imageFile, const char *labelFile,
+                          uint32_t flags, int cellSize, int numBins, HOGStorage storage,
+                          int quantBins, int numThreads, HOGFeatures *hogFeatures) {
+    HOGCacheSource imageSource, labelSource;
+    uint64_t key;
+    if (!hogCacheKey(imageFile, labelFile, cellSize, numBins, storage, quantBins, flags,
+                     &imageSource, &labelSource, &key)) {
+        printf("Failed to find %s or %s\n", imageFile, labelFile);
+        return 0;
+    }
+    char path[strlen(cacheDir) + 32];
+    snprintf(path, sizeof(path), "%s/hog-%016llx.bin", cacheDir, (unsigned long long)key);
+
+    if (mapHOGCache(path, key, &imageSource, &labelSource, hogFeatures, storage, quantBins)) {
+        printf("Loaded cached HOG features from %s: %u images, %u features per image\n",
+               path, hogFeatures->numImages, hogFeatures->numFeatures);
+        return 1;
+    }
+
+    MNISTDataset dataset;
+    if (!loadMNISTDataset(imageFile, labelFile, &dataset)) {
+        return 0;
+    }
+    if (flags & HOG_CACHE_EMNIST_TRANSFORM) {
+        transformEMNISTDataset(&dataset);
+    }
+    if (flags & HOG_CACHE_ZERO_BASED_LABELS) {
+        for (uint32_t i = 0; i < dataset.numImages; i++) {
+            if (dataset.labels[i] > 0) {
+                dataset.labels[i] -= 1;
+            }
+        }
+    }
+
+    hogFeatures->numImages = dataset.numImages;
+    hogFeatures->numFeatures = (dataset.rows/cellSize) * (dataset.cols/cellSize) * numBins;
+    extractHOGFeaturesAs(&dataset, hogFeatures, cellSize, numBins, storage, quantBins, numThreads);
+    freeMNISTDataset(&dataset);
+
+    bool extracted = (storage == HOG_STORAGE_DOUBLE ? (void*)hogFeatures->features :
+                      storage == HOG_STORAGE_FLOAT ? (void*)hogFeatures->featuresFloat :
+                      (void*)hogFeatures->bins) != NULL;
+    if (!extracted) {
+        return 0;
+    }
+
+    // Files replaced while they were being read would be cached under the
+    // wrong identity
+    HOGCacheSource imageAfter, labelAfter;
+    uint64_t keyAfter;
+    if (!hogCacheKey(imageFile, labelFile, cellSize, numBins, storage, quantBins, flags,
+                     &imageAfter, &labelAfter, &keyAfter) || keyAfter != key) {
+        printf("Not caching HOG features: %s or %s changed while being read\n", imageFile, labelFile);
+        return 1;
+    }
+
+    mkdir(cacheDir, 0755);  // Fine if it already exists
+    if (writeHOGCache(path, key, &imageSource, &labelSource, hogFeatures)) {
+        printf("Saved HOG features to cache %s\n", path);
+    }
+    return 1;
+}
@@ -0,0 +1,64 @@
+#ifndef FEATURE_CACHE_H
+#define FEATURE_CACHE_H
+
+#include <stdint.h>
+#include "mnist_loader.h"
+#include "hog.h"
+
+#define HOG_CACHE_MAGIC 0x43474F48u  // "HOGC"
+#define HOG_CACHE_VERSION 4
+
+// Flags saying how the dataset is prepared before extraction. They are part
+// of the cache key along with the IDX files and the HOG parameters.
+#define HOG_CACHE_EMNIST_TRANSFORM 0x1u  // Images go through transformEMNISTDataset
+#define HOG_CACHE_ZERO_BASED_LABELS 0x2u // EMNIST letter labels 1-26 become 0-25
+
+// Identity of an IDX file the features were extracted from. Besides what
+// stat reports, a sample of the bytes (the IDX header and blocks spread over
+// the file) is hashed, so copies with preserved timestamps and files rewritten
+// within one clock tick are told apart.
+typedef struct {
+    uint64_t size;
+    int64_t mtimeNs;       // Modification time in nanoseconds
+    uint64_t device;
+    uint64_t inode;
+    uint64_t sampleHash;
+} HOGCacheSource;
+
+// Header of a feature cache file. The feature values follow it, then the
+// labels (if any). 128 bytes, so the values start aligned.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;          // hogCacheKey of the files and parameters
+    HOGCacheSource images; // The files the features came from, checked on a hit
+    HOGCacheSource labels;
+    uint32_t numImages;
+    uint32_t numFeatures;
+    int32_t storage;       // HOGStorage
+    int32_t quantBins;
+    uint64_t valueBytes;   // Bytes of feature values after the header
+    uint32_t hasLabels;
+    uint8_t padding[4];
+} HOGCacheHeader;
+
+// Key of the features of an IDX file pair: the identity of each file (or of
+// FILENAME.gz, as the loader would pick) together with the HOG parameters,
+// storage form and preparation flags. The identities are returned too, for
+// the cache header. Only the sampled blocks are read from the files. Returns
+// 0 if either file is missing or can't be read.
+int hogCacheKey(const char *imageFile, const char *labelFile, int cellSize, int numBins,
+                HOGStorage storage, int quantBins, uint32_t flags,
+                HOGCacheSource *imageSource, HOGCacheSource *labelSource, uint64_t *key);
+
+// Load an IDX file pair, prepare it as flags say and extract its HOG
+// features, like loadMNISTDataset followed by extractHOGFeaturesAs. The cache
+// in cacheDir is looked up first, so a hit never loads the files: features
+// and labels are mapped from the cache file straight into hogFeatures. A miss
+// extracts and writes the cache for next time. freeHOGFeatures releases
+// either kind. Returns 0 on failure.
+int loadHOGFeaturesCached(const char *cacheDir, const char *imageFile, const char *labelFile,
+                          uint32_t flags, int cellSize, int numBins, HOGStorage storage,
+                          int quantBins, int numThreads, HOGFeatures *hogFeatures);
+
+#endif // FEATURE_CACHE_H
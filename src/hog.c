@@ -2,12 +2,36 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include "hog.h"
+#include "parallel.h"
 
-static void computeGradient(uint8_t *image, uint32_t rows, uint32_t cols, 
-    int x, int y, double *magnitude, double *orientation) {
-    
-    double dx, dy;
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HOG_X86_SIMD 1
+#endif
+
+// dx and dy are differences of two uint8 pixels, so both lie in [-255, 255]
+#define GRADIENT_RANGE 511
+
+// Gradient planes: images up to PLANE_MAX_DIM square, rows padded to whole
+// 16-pixel vectors, plus 2 border columns and slack for the last vector load
+#define PLANE_MAX_DIM 64
+#define PLANE_STRIDE ((PLANE_MAX_DIM + 15) / 16 * 16)
+#define PADDED_STRIDE (PLANE_STRIDE + 16)
+
+static HOGGradientMethod gGradientMethod = HOG_GRADIENT_SIMD;
+
+// Gradient lookup tables, filled on first use
+static double gMagnitudeLUT[256 * 256];                   // [|dy|][|dx|]
+static uint8_t gBinLUT[GRADIENT_RANGE * GRADIENT_RANGE];  // [dy + 255][dx + 255]
+static int gMagnitudeLUTReady = 0;
+static int gBinLUTBins = 0;                               // numBins gBinLUT was built for
+
+// Central differences at (x, y), clamping at the image border
+static void pixelDifferences(const uint8_t *image, uint32_t rows, uint32_t cols,
+    int x, int y, int *dx, int *dy) {
 
     // Handle image boundaries with mirroring
     uint32_t left = (x > 0) ? (uint32_t)(x - 1) : 0;
@@ -16,39 +40,435 @@ static void computeGradient(uint8_t *image, uint32_t rows, uint32_t cols,
     uint32_t bottom = (y < (int)(rows - 1)) ? (uint32_t)(y + 1) : rows - 1;
 
     // Compute gradients using central differences
-    dx = (double)image[y * cols + right] - (double)image[y * cols + left];
-    dy = (double)image[bottom * cols + x] - (double)image[top * cols + x];
+    *dx = (int)image[y * cols + right] - (int)image[y * cols + left];
+    *dy = (int)image[bottom * cols + x] - (int)image[top * cols + x];
+}
 
-    // Calculate magnitude
-    *magnitude = sqrt(dx * dx + dy * dy);
-    
+// Orientation of a gradient in degrees, in the range [0, 180)
+static double gradientOrientation(double dx, double dy) {
     // Handle the case when gradient is zero (avoid undefined orientation)
     if (fabs(dx) < 1e-6 && fabs(dy) < 1e-6) {
-        *orientation = 0;
-    } else {
-        // Calculate orientation in the range [-pi, pi]
-        *orientation = atan2(dy, dx);
+        return 0;
+    }
+
+    // Calculate orientation in the range [-pi, pi]
+    double orientation = atan2(dy, dx);
+
+    // Convert orientation to degrees in the range [0, 180)
+    return fmod((orientation * 180.0 / M_PI) + 180.0, 180.0);
+}
+
+// Determine which bin the orientation falls into
+static int orientationBin(double orientation, int numBins) {
+    int bin = (int)(orientation * numBins / 180.0);
+    if (bin >= numBins) bin = numBins - 1; // Safety check
+    return bin;
+}
+
+static void computeGradient(const uint8_t *image, uint32_t rows, uint32_t cols, 
+    int x, int y, double *magnitude, double *orientation) {
+    
+    int dx, dy;
+    pixelDifferences(image, rows, cols, x, y, &dx, &dy);
+
+    // Calculate magnitude
+    *magnitude = sqrt((double)dx * dx + (double)dy * dy);
+    *orientation = gradientOrientation(dx, dy);
+}
+
+// Fill the lookup tables for numBins orientation bins. The entries come from
+// the same arithmetic as computeGradient, so both paths give identical
+// histograms. Not safe to call while another thread is extracting.
+static int prepareGradientLUT(int numBins) {
+    if (numBins > 256) {
+        return 0;  // Bins don't fit the uint8 table
+    }
+
+    if (!gMagnitudeLUTReady) {
+        for (int dy = 0; dy < 256; dy++) {
+            for (int dx = 0; dx < 256; dx++) {
+                gMagnitudeLUT[dy * 256 + dx] = sqrt((double)dx * dx + (double)dy * dy);
+            }
+        }
+        gMagnitudeLUTReady = 1;
+    }
+
+    if (gBinLUTBins != numBins) {
+        for (int dy = -255; dy <= 255; dy++) {
+            for (int dx = -255; dx <= 255; dx++) {
+                gBinLUT[(dy + 255) * GRADIENT_RANGE + (dx + 255)] =
+                    (uint8_t)orientationBin(gradientOrientation(dx, dy), numBins);
+            }
+        }
+        gBinLUTBins = numBins;
+    }
+
+    return 1;
+}
+
+void setHOGGradientMethod(HOGGradientMethod method) {
+    gGradientMethod = method;
+}
+
+HOGGradientMethod getHOGGradientMethod(void) {
+    return gGradientMethod;
+}
+
+void prepareHOGExtraction(int numBins) {
+    if (gGradientMethod != HOG_GRADIENT_DIRECT) {
+        prepareGradientLUT(numBins);
+    }
+}
+
+// L2-normalize a cell histogram into the feature vector
+static void storeCellHistogram(const double *histogram, int numBins, double *cellFeatures) {
+    double sum = 0.0;
+    for (int b = 0; b < numBins; b++) {
+        sum += histogram[b] * histogram[b];
+    }
+    double norm = sqrt(sum + 1e-6); // Avoid division by zero
+    
+    // Store normalized histogram in feature vector
+    for (int b = 0; b < numBins; b++) {
+        cellFeatures[b] = histogram[b] / norm;
+    }
+}
+
+// Histogram of one cell straight from the image, normalized into cellFeatures.
+// Same pixel order and gradient tables as the plane path, so the values are identical.
+static void storeCellFeatures(const uint8_t *image, uint32_t rows, uint32_t cols, int cellSize,
+                              int numBins, int cx, int cy, int useLUT, double *cellFeatures) {
+    // make histogram for this cell (one bin for each orientation range)
+    double histogram[numBins];
+    memset(histogram, 0, numBins * sizeof(double));
+    
+    // Process each pixel in the cell
+    for (int y = cy * cellSize; y < (cy + 1) * cellSize; y++) {
+        for (int x = cx * cellSize; x < (cx + 1) * cellSize; x++) {
+            double magnitude;
+            int bin;
+            if (useLUT) {
+                int dx, dy;
+                pixelDifferences(image, rows, cols, x, y, &dx, &dy);
+                magnitude = gMagnitudeLUT[abs(dy) * 256 + abs(dx)];
+                bin = gBinLUT[(dy + 255) * GRADIENT_RANGE + (dx + 255)];
+            } else {
+                double orientation;
+                computeGradient(image, rows, cols, x, y, 
+                            &magnitude, &orientation);
+                bin = orientationBin(orientation, numBins);
+            }
+            
+            // Add weighted magnitude to the histogram
+            histogram[bin] += magnitude;
+        }
+    }
+    
+    // Normalize the histogram and store in feature vector
+    storeCellHistogram(histogram, numBins, cellFeatures);
+}
+
+// Columns of the gradient planes actually computed for an image width
+static int planeCols(int cols) {
+    return (cols + 15) / 16 * 16;
+}
+
+// Copy the image into a buffer with a one-pixel border that repeats the
+// edge pixels, matching the clamping in pixelDifferences
+static void padImage(const uint8_t *image, int rows, int cols, uint8_t *padded) {
+    for (int y = -1; y <= rows; y++) {
+        const uint8_t *src = &image[(y < 0 ? 0 : (y >= rows ? rows - 1 : y)) * cols];
+        uint8_t *dst = &padded[(y + 1) * PADDED_STRIDE];
+        dst[0] = src[0];
+        memcpy(dst + 1, src, cols);
+        dst[cols + 1] = src[cols - 1];
+    }
+}
+
+// dx/dy planes for the whole image from the padded copy, no border branches.
+// Rows are computed in whole 16-pixel vectors; entries past cols are unused.
+static void gradientPlanesScalar(const uint8_t *padded, int rows, int cols,
+                                 int16_t *dxPlane, int16_t *dyPlane) {
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *above = &padded[y * PADDED_STRIDE + 1];
+        const uint8_t *row = &padded[(y + 1) * PADDED_STRIDE];
+        const uint8_t *below = &padded[(y + 2) * PADDED_STRIDE + 1];
+        for (int x = 0; x < planeCols(cols); x++) {
+            dxPlane[y * PLANE_STRIDE + x] = (int16_t)(row[x + 2] - row[x]);
+            dyPlane[y * PLANE_STRIDE + x] = (int16_t)(below[x] - above[x]);
+        }
+    }
+}
+
+#ifdef HOG_X86_SIMD
+// Same as gradientPlanesScalar, 8 pixels per step (SSE2 is always present on x86-64)
+static void gradientPlanesSSE2(const uint8_t *padded, int rows, int cols,
+                               int16_t *dxPlane, int16_t *dyPlane) {
+    const __m128i zero = _mm_setzero_si128();
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *above = &padded[y * PADDED_STRIDE + 1];
+        const uint8_t *row = &padded[(y + 1) * PADDED_STRIDE];
+        const uint8_t *below = &padded[(y + 2) * PADDED_STRIDE + 1];
+        for (int x = 0; x < planeCols(cols); x += 8) {
+            __m128i right = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&row[x + 2]), zero);
+            __m128i left = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&row[x]), zero);
+            __m128i down = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&below[x]), zero);
+            __m128i up = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&above[x]), zero);
+            _mm_storeu_si128((__m128i*)&dxPlane[y * PLANE_STRIDE + x], _mm_sub_epi16(right, left));
+            _mm_storeu_si128((__m128i*)&dyPlane[y * PLANE_STRIDE + x], _mm_sub_epi16(down, up));
+        }
+    }
+}
+
+// Same as gradientPlanesScalar, 16 pixels per step
+__attribute__((target("avx2")))
+static void gradientPlanesAVX2(const uint8_t *padded, int rows, int cols,
+                               int16_t *dxPlane, int16_t *dyPlane) {
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *above = &padded[y * PADDED_STRIDE + 1];
+        const uint8_t *row = &padded[(y + 1) * PADDED_STRIDE];
+        const uint8_t *below = &padded[(y + 2) * PADDED_STRIDE + 1];
+        for (int x = 0; x < planeCols(cols); x += 16) {
+            __m256i right = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&row[x + 2]));
+            __m256i left = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&row[x]));
+            __m256i down = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&below[x]));
+            __m256i up = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)&above[x]));
+            _mm256_storeu_si256((__m256i*)&dxPlane[y * PLANE_STRIDE + x], _mm256_sub_epi16(right, left));
+            _mm256_storeu_si256((__m256i*)&dyPlane[y * PLANE_STRIDE + x], _mm256_sub_epi16(down, up));
+        }
+    }
+}
+#endif
+
+// Two-stage HOG for one image: gradient planes for the whole image first,
+// then per-cell histograms from the planes through the lookup tables.
+// Needs rows, cols <= PLANE_MAX_DIM and prepareGradientLUT(numBins).
+static void computeHOGImageFromPlanes(const uint8_t *image, int rows, int cols,
+                                      int cellSize, int numBins, double *imgFeatures) {
+    uint8_t padded[(PLANE_MAX_DIM + 2) * PADDED_STRIDE];
+    int16_t dxPlane[PLANE_MAX_DIM * PLANE_STRIDE];
+    int16_t dyPlane[PLANE_MAX_DIM * PLANE_STRIDE];
+
+    // Columns past the image only feed plane entries that are never read
+    memset(padded, 0, (rows + 2) * PADDED_STRIDE);
+    padImage(image, rows, cols, padded);
+
+    // Pick the widest gradient pass this CPU supports
+#ifdef HOG_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        gradientPlanesAVX2(padded, rows, cols, dxPlane, dyPlane);
+    } else if (__builtin_cpu_supports("sse2")) {
+        gradientPlanesSSE2(padded, rows, cols, dxPlane, dyPlane);
+    } else
+#endif
+    {
+        gradientPlanesScalar(padded, rows, cols, dxPlane, dyPlane);
+    }
+
+    int cellsX = cols / cellSize;
+    int cellsY = rows / cellSize;
+
+    for (int cy = 0; cy < cellsY; cy++) {
+        for (int cx = 0; cx < cellsX; cx++) {
+            double histogram[numBins];
+            memset(histogram, 0, numBins * sizeof(double));
+
+            // Same pixel order as computeHOGImage, so the sums are identical
+            for (int y = cy * cellSize; y < (cy + 1) * cellSize; y++) {
+                for (int x = cx * cellSize; x < (cx + 1) * cellSize; x++) {
+                    int dx = dxPlane[y * PLANE_STRIDE + x];
+                    int dy = dyPlane[y * PLANE_STRIDE + x];
+                    histogram[gBinLUT[(dy + 255) * GRADIENT_RANGE + (dx + 255)]] +=
+                        gMagnitudeLUT[abs(dy) * 256 + abs(dx)];
+                }
+            }
+
+            storeCellHistogram(histogram, numBins, &imgFeatures[(cy * cellsX + cx) * numBins]);
+        }
+    }
+}
+
+void computeHOGImage(const uint8_t *image, uint32_t rows, uint32_t cols,
+                     int cellSize, int numBins, double *imgFeatures) {
+    if (gGradientMethod == HOG_GRADIENT_SIMD && rows <= PLANE_MAX_DIM && cols <= PLANE_MAX_DIM &&
+        rows > 0 && cols > 0 && prepareGradientLUT(numBins)) {
+        computeHOGImageFromPlanes(image, rows, cols, cellSize, numBins, imgFeatures);
+        return;
+    }
+
+    //calculate number of cells in each direction
+    int cellsX = cols / cellSize;
+    int cellsY = rows / cellSize;
+
+    int useLUT = gGradientMethod != HOG_GRADIENT_DIRECT && prepareGradientLUT(numBins);
+
+    // process cell
+    for (int cy = 0; cy < cellsY; cy++) {
+        for (int cx = 0; cx < cellsX; cx++) {
+            storeCellFeatures(image, rows, cols, cellSize, numBins, cx, cy, useLUT,
+                              &imgFeatures[(cy * cellsX + cx) * numBins]);
+        }
+    }
+}
+
+int markChangedHOGCells(const uint8_t *before, const uint8_t *after, uint32_t rows, uint32_t cols,
+                        int cellSize, uint8_t *dirtyCells) {
+    int cellsX = cols / cellSize;
+    int cellsY = rows / cellSize;
+    int numDirty = 0;
+    memset(dirtyCells, 0, cellsX * cellsY);
+
+    // A pixel feeds the central differences at itself (through the border
+    // clamping) and at its four neighbours
+    static const int offsets[5][2] = {{0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    for (int y = 0; y < (int)rows; y++) {
+        // Strokes touch few rows; skip unchanged ones whole
+        if (memcmp(&before[y * cols], &after[y * cols], cols) == 0) {
+            continue;
+        }
+        for (int x = 0; x < (int)cols; x++) {
+            if (before[y * cols + x] == after[y * cols + x]) {
+                continue;
+            }
+            for (int k = 0; k < 5; k++) {
+                int cx = (x + offsets[k][0]) / cellSize;
+                int cy = (y + offsets[k][1]) / cellSize;
+                if (x + offsets[k][0] < 0 || y + offsets[k][1] < 0 || cx >= cellsX || cy >= cellsY) {
+                    continue;
+                }
+                if (!dirtyCells[cy * cellsX + cx]) {
+                    dirtyCells[cy * cellsX + cx] = 1;
+                    numDirty++;
+                }
+            }
+        }
+    }
+    return numDirty;
+}
+
+void computeHOGCells(const uint8_t *image, uint32_t rows, uint32_t cols, int cellSize, int numBins,
+                     const uint8_t *dirtyCells, double *imgFeatures) {
+    int cellsX = cols / cellSize;
+    int cellsY = rows / cellSize;
+    int useLUT = gGradientMethod != HOG_GRADIENT_DIRECT && prepareGradientLUT(numBins);
+
+    for (int cy = 0; cy < cellsY; cy++) {
+        for (int cx = 0; cx < cellsX; cx++) {
+            if (dirtyCells[cy * cellsX + cx]) {
+                storeCellFeatures(image, rows, cols, cellSize, numBins, cx, cy, useLUT,
+                                  &imgFeatures[(cy * cellsX + cx) * numBins]);
+            }
+        }
+    }
+}
+
+// Shared state for extraction workers
+typedef struct {
+    MNISTDataset *dataset;
+    HOGFeatures *hogFeatures;
+    int cellSize;
+    int numBins;
+    atomic_uint processed;  // Images finished so far, across all workers
+} HOGExtractContext;
+
+// Round a feature value to float without moving it out of its bin of
+// numBins (if > 0). The nearest float is at most one step past a bin edge,
+// so each loop runs at most once.
+static float narrowHOGValue(double value, int numBins) {
+    float narrowed = (float)value;
+    if (numBins > 0) {
+        int bin = hogValueBin(value, numBins);
+        while (hogValueBin(narrowed, numBins) > bin) {
+            narrowed = nextafterf(narrowed, -INFINITY);
+        }
+        while (hogValueBin(narrowed, numBins) < bin) {
+            narrowed = nextafterf(narrowed, INFINITY);
+        }
+    }
+    return narrowed;
+}
+
+static void extractHOGWorker(uint32_t begin, uint32_t end, int worker, void *context) {
+    HOGExtractContext *extract = (HOGExtractContext*)context;
+    MNISTDataset *dataset = extract->dataset;
+    HOGFeatures *hogFeatures = extract->hogFeatures;
+    (void)worker;
+
+    uint32_t numFeatures = hogFeatures->numFeatures;
+    double imgFeatures[numFeatures];
+
+    // Each image writes only its own slice of the feature matrix
+    for (uint32_t imgIdx = begin; imgIdx < end; imgIdx++) {
+        size_t offset = (size_t)imgIdx * numFeatures;
+        double *out = hogFeatures->storage == HOG_STORAGE_DOUBLE ?
+            &hogFeatures->features[offset] : imgFeatures;
+        computeHOGImage(&dataset->images[imgIdx * dataset->imageSize], dataset->rows, dataset->cols,
+                        extract->cellSize, extract->numBins, out);
+
+        // Narrow to the compact storage form
+        if (hogFeatures->storage == HOG_STORAGE_FLOAT) {
+            for (uint32_t f = 0; f < numFeatures; f++) {
+                hogFeatures->featuresFloat[offset + f] = narrowHOGValue(imgFeatures[f], hogFeatures->quantBins);
+            }
+        } else if (hogFeatures->storage == HOG_STORAGE_BINNED) {
+            for (uint32_t f = 0; f < numFeatures; f++) {
+                hogFeatures->bins[offset + f] = (uint8_t)hogValueBin(imgFeatures[f], hogFeatures->quantBins);
+            }
+        }
         
-        // Convert orientation to degrees in the range [0, 180)
-        *orientation = fmod((*orientation * 180.0 / M_PI) + 180.0, 180.0);
+        // Print progress; the counter hands out every value exactly once
+        unsigned done = atomic_fetch_add(&extract->processed, 1) + 1;
+        if (done % 10000 == 0 || done == dataset->numImages) {
+            printf("Processed %u/%u images\n", done, dataset->numImages);
+        }
     }
 }
 
 void extractHOGFeatures(MNISTDataset *dataset, HOGFeatures *hogFeatures, int cellSize, int numBins) {
-    //calculate number of cells in each direction
-    int cellsX = dataset->cols / cellSize;
-    int cellsY = dataset->rows / cellSize;
+    extractHOGFeaturesParallel(dataset, hogFeatures, cellSize, numBins, 1);
+}
+
+void extractHOGFeaturesParallel(MNISTDataset *dataset, HOGFeatures *hogFeatures,
+                                int cellSize, int numBins, int numThreads) {
+    extractHOGFeaturesAs(dataset, hogFeatures, cellSize, numBins, HOG_STORAGE_DOUBLE, 0, numThreads);
+}
+
+void extractHOGFeaturesAs(MNISTDataset *dataset, HOGFeatures *hogFeatures,
+                          int cellSize, int numBins, HOGStorage storage, int quantBins,
+                          int numThreads) {
+    size_t numValues = (size_t)hogFeatures->numImages * hogFeatures->numFeatures;
+    hogFeatures->storage = storage;
+    hogFeatures->quantBins = quantBins;
+    hogFeatures->features = NULL;
+    hogFeatures->featuresFloat = NULL;
+    hogFeatures->bins = NULL;
+    hogFeatures->mapping = NULL;
+
+    if (storage == HOG_STORAGE_BINNED && (quantBins <= 0 || quantBins > 256)) {
+        printf("Invalid bin count %d for binned HOG features\n", quantBins);
+        hogFeatures->labels = NULL;
+        return;
+    }
 
     //calculate the number of hog features in the image
-    hogFeatures->features = (double*)malloc(hogFeatures->numImages * hogFeatures->numFeatures * sizeof(double));
+    void *values;
+    if (storage == HOG_STORAGE_FLOAT) {
+        values = hogFeatures->featuresFloat = (float*)calloc(numValues, sizeof(float));
+    } else if (storage == HOG_STORAGE_BINNED) {
+        values = hogFeatures->bins = (uint8_t*)calloc(numValues, sizeof(uint8_t));
+    } else {
+        values = hogFeatures->features = (double*)calloc(numValues, sizeof(double));
+    }
 
     // Only allocate and copy labels if we have them in the dataset
     if (dataset->labels != NULL) {
         hogFeatures->labels = (uint8_t*)malloc(hogFeatures->numImages * sizeof(uint8_t));
         if (hogFeatures->labels == NULL) {
             printf("failed to allocate memory for HOG labels\n");
-            free(hogFeatures->features);
+            free(values);
             hogFeatures->features = NULL;
+            hogFeatures->featuresFloat = NULL;
+            hogFeatures->bins = NULL;
             return;
         }
         memcpy(hogFeatures->labels, dataset->labels, hogFeatures->numImages * sizeof(uint8_t));
@@ -56,73 +476,46 @@ void extractHOGFeatures(MNISTDataset *dataset, HOGFeatures *hogFeatures, int cel
         hogFeatures->labels = NULL;  // Explicitly set to NULL if no labels
     }
 
-    if (hogFeatures->features == NULL) {
+    if (values == NULL) {
         printf("failed to allocate memory for HOG features\n");
         return;
     }
-
-    // Initialize all features to zero
-    memset(hogFeatures->features, 0, hogFeatures->numImages * hogFeatures->numFeatures * sizeof(double));
     
+    // Build the gradient tables before any worker reads them
+    prepareHOGExtraction(numBins);
+
     // Process images
-    for (uint32_t imgIdx = 0; imgIdx < dataset->numImages; imgIdx++) {
-        uint8_t *image = &dataset->images[imgIdx * dataset->imageSize];
-        double *imgFeatures = &hogFeatures->features[imgIdx * hogFeatures->numFeatures];
-        
-        // process cell
-        for (int cy = 0; cy < cellsY; cy++) {
-            for (int cx = 0; cx < cellsX; cx++) {
-                // make histogram for this cell (one bin for each orientation range)
-                double histogram[numBins];
-                memset(histogram, 0, numBins * sizeof(double));
-                
-                // Process each pixel in the cell
-                for (int y = cy * cellSize; y < (cy + 1) * cellSize; y++) {
-                    for (int x = cx * cellSize; x < (cx + 1) * cellSize; x++) {
-                        double magnitude, orientation;
-                        computeGradient(image, dataset->rows, dataset->cols, x, y, 
-                                    &magnitude, &orientation);
-                        
-                        // Determine which bin the orientation falls into
-                        int bin = (int)(orientation * numBins / 180.0);
-                        if (bin >= numBins) bin = numBins - 1; // Safety check
-                        
-                        // Add weighted magnitude to the histogram
-                        histogram[bin] += magnitude;
-                    }
-                }
-                
-                // Normalize the histogram and store in feature vector
-                double sum = 0.0;
-                for (int b = 0; b < numBins; b++) {
-                    sum += histogram[b] * histogram[b];
-                }
-                double norm = sqrt(sum + 1e-6); // Avoid division by zero
-                
-                // Store normalized histogram in feature vector
-                int featureOffset = (cy * cellsX + cx) * numBins;
-                for (int b = 0; b < numBins; b++) {
-                    imgFeatures[featureOffset + b] = histogram[b] / norm;
-                }
-            }
-        }
-        
-        // Print progress
-        if ((imgIdx + 1) % 10000 == 0 || imgIdx + 1 == dataset->numImages) {
-            printf("Processed %u/%u images\n", imgIdx + 1, dataset->numImages);
-        }
-    }
+    HOGExtractContext extract = {dataset, hogFeatures, cellSize, numBins, 0};
+    parallelFor(dataset->numImages, numThreads, extractHOGWorker, &extract);
 
     printf("Extracted HOG features: %u images, %u features per image\n", 
         hogFeatures->numImages, hogFeatures->numFeatures);
 }
 
 void freeHOGFeatures(HOGFeatures *hogFeatures) {
-    if (hogFeatures) {
+    if (hogFeatures && hogFeatures->mapping) {
+        // Features and labels all live in the mapped cache file
+        munmap(hogFeatures->mapping, hogFeatures->mappingSize);
+        hogFeatures->mapping = NULL;
+        hogFeatures->features = NULL;
+        hogFeatures->featuresFloat = NULL;
+        hogFeatures->bins = NULL;
+        hogFeatures->labels = NULL;
+    } else if (hogFeatures) {
         if (hogFeatures->features) {
             free(hogFeatures->features);
             hogFeatures->features = NULL;
         }
+
+        if (hogFeatures->featuresFloat) {
+            free(hogFeatures->featuresFloat);
+            hogFeatures->featuresFloat = NULL;
+        }
+
+        if (hogFeatures->bins) {
+            free(hogFeatures->bins);
+            hogFeatures->bins = NULL;
+        }
         
         if (hogFeatures->labels) {
             free(hogFeatures->labels);
@@ -4,18 +4,86 @@
 #include <stdint.h>
 #include "mnist_loader.h"
 
+// How extracted feature values are stored
+typedef enum {
+    HOG_STORAGE_DOUBLE,   // features
+    HOG_STORAGE_FLOAT,    // featuresFloat, half the memory; kept in their quantBins bins (if set)
+    HOG_STORAGE_BINNED    // bins: each value already mapped to one of quantBins bins
+} HOGStorage;
+
 // Structure to hold HOG features
 typedef struct {
     double *features;     // HOG feature vector
+    float *featuresFloat; // Single-precision feature vector (HOG_STORAGE_FLOAT)
+    uint8_t *bins;        // Value bin of every feature (HOG_STORAGE_BINNED)
+    HOGStorage storage;   // Which of the three arrays above holds the features
+    int quantBins;        // Bins the values were mapped to, or kept in (see HOGStorage)
     uint32_t numFeatures; // Number of features per image
     uint32_t numImages;   // Number of images
     uint8_t *labels;      // Labels (copied from original dataset)
+    void *mapping;        // Mapped feature cache the arrays point into, else NULL
+    size_t mappingSize;
 } HOGFeatures;
 
+// Bin of a normalized feature value when [0, 1] is split into numBins bins.
+// This is the binning the Naive Bayes model applies to every feature.
+static inline int hogValueBin(double value, int numBins) {
+    double binWidth = 1.0 / numBins;
+    value = (value < 0) ? 0 : (value > 1.0 ? 1.0 : value);
+    int bin = (int)(value / binWidth);
+    return (bin < 0) ? 0 : (bin >= numBins ? numBins - 1 : bin);
+}
+
+// How per-pixel gradient magnitude and orientation bin are computed
+typedef enum {
+    HOG_GRADIENT_DIRECT,  // sqrt/atan2/fmod for every pixel
+    HOG_GRADIENT_LUT,     // Lookup tables over all (dx, dy) pairs; identical results
+    HOG_GRADIENT_SIMD     // Whole-image dx/dy planes (AVX2/SSE2, scalar elsewhere), then LUT
+} HOGGradientMethod;
+
+// Select the gradient method used by all later extractions (default: SIMD)
+void setHOGGradientMethod(HOGGradientMethod method);
+HOGGradientMethod getHOGGradientMethod(void);
+
+// Build the gradient tables for numBins orientation bins. Call this before
+// running computeHOGImage from several threads at once.
+void prepareHOGExtraction(int numBins);
+
 // Extract HOG features from an MNIST dataset
 void extractHOGFeatures(MNISTDataset *dataset, HOGFeatures *hogFeatures, 
                         int cellSize, int numBins);
 
+// Same as extractHOGFeatures, spread over numThreads worker threads
+// (<= 0 for the default count). Output is identical to the serial path.
+void extractHOGFeaturesParallel(MNISTDataset *dataset, HOGFeatures *hogFeatures,
+                                int cellSize, int numBins, int numThreads);
+
+// Same as extractHOGFeaturesParallel, storing the features in the given form.
+// For HOG_STORAGE_BINNED, quantBins must equal the model's numBins. Rounding
+// to float can carry a value across a bin edge, so for HOG_STORAGE_FLOAT
+// with quantBins > 0 each value is nudged back into the bin its double falls
+// in: a model with quantBins bins then sees the same bins as from doubles.
+// With quantBins <= 0 floats are plain roundings of the doubles.
+void extractHOGFeaturesAs(MNISTDataset *dataset, HOGFeatures *hogFeatures,
+                          int cellSize, int numBins, HOGStorage storage, int quantBins,
+                          int numThreads);
+
+// Compute the HOG feature vector of a single image into imgFeatures
+// ((rows/cellSize) * (cols/cellSize) * numBins values)
+void computeHOGImage(const uint8_t *image, uint32_t rows, uint32_t cols,
+                     int cellSize, int numBins, double *imgFeatures);
+
+// Flag in dirtyCells[(rows/cellSize) * (cols/cellSize)] every cell whose
+// features can differ between two versions of an image: the cells holding a
+// changed pixel or a pixel next to one. Returns the number of cells flagged.
+int markChangedHOGCells(const uint8_t *before, const uint8_t *after, uint32_t rows, uint32_t cols,
+                        int cellSize, uint8_t *dirtyCells);
+
+// Recompute only the cells flagged in dirtyCells, leaving the rest of
+// imgFeatures as it is. Flagged cells get exactly the computeHOGImage values.
+void computeHOGCells(const uint8_t *image, uint32_t rows, uint32_t cols, int cellSize, int numBins,
+                     const uint8_t *dirtyCells, double *imgFeatures);
+
 // Free memory allocated for HOG features
 void freeHOGFeatures(HOGFeatures *hogFeatures);
 
@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "mnist_loader.h"
 #include "hog.h"
 #include "naive_bayes.h"
+#include "classifier.h"
+#include "feature_cache.h"
+#include "parallel.h"
 #include "utils.h"
 
 // Function to convert numeric label to character
@@ -24,89 +28,431 @@ void adjustLabels(MNISTDataset *dataset) {
     }
 }
 
-int main() {
+// Images per batch when training data is fed to the model in batches
+#define TRAIN_BATCH_SIZE 8192
+
+// Train on EMNIST letters turned upright, like the interactive recognizer's
+// training data. The images may be a read-only mapping, so each batch is
+// copied to a private buffer and transformed there.
+static int trainUprightLetters(NaiveBayesModel *model, const MNISTDataset *letters,
+                               int cellSize, int numBins) {
+    NaiveBayesTrainer trainer;
+    uint8_t *upright = (uint8_t*)malloc((size_t)TRAIN_BATCH_SIZE * letters->imageSize);
+    if (upright == NULL) {
+        printf("Failed to allocate memory for upright images\n");
+        return 0;
+    }
+    if (!beginNaiveBayesTraining(&trainer, model, cellSize, numBins, 0)) {
+        free(upright);
+        return 0;
+    }
+
+    for (uint32_t begin = 0; begin < letters->numImages; begin += TRAIN_BATCH_SIZE) {
+        uint32_t end = letters->numImages - begin > TRAIN_BATCH_SIZE ? begin + TRAIN_BATCH_SIZE : letters->numImages;
+        MNISTDataset batch = sliceMNISTDataset(letters, begin, end);
+        memcpy(upright, batch.images, (size_t)batch.numImages * batch.imageSize);
+        batch.images = upright;
+        for (uint32_t i = 0; i < batch.numImages; i++) {
+            transformEMNISTImage(&upright[(size_t)i * batch.imageSize], batch.rows, batch.cols);
+        }
+        addNaiveBayesTrainingImages(&trainer, &batch);
+    }
+
+    free(upright);
+    return finishNaiveBayesTraining(&trainer);
+}
+
+// Train a model the same way the interactive recognizer does and write it to
+// disk. Like the recognizer, the model quantizes feature values into numBins
+// bins (one per HOG orientation bin) rather than the evaluation run's finer
+// modelBins, so the saved model is the one the recognizer would train itself.
+// With numShards > 1 only the shardIndex-th of numShards contiguous slices of
+// the training set is used; merging the models of all shards gives exactly
+// the model trained on the whole set.
+int trainAndSaveModel(int recognizeLetters, const char *modelFile,
+                      int cellSize, int numBins, int shardIndex, int numShards) {
+    MNISTDataset trainDataset;
+    NaiveBayesModel model;
+    int numClasses = recognizeLetters ? 26 : 10;
+
+    const char *imageFile, *labelFile;
+    if (recognizeLetters) {
+        imageFile = "data/emnist-letters-train-images-idx3-ubyte";
+        labelFile = "data/emnist-letters-train-labels-idx1-ubyte";
+    } else {
+        imageFile = "data/train-images-idx3-ubyte";
+        labelFile = "data/train-labels-idx1-ubyte";
+    }
+
+    // Mapped, so a shard only pages in its own slice of the files
+    printf("Loading training data...\n");
+    if (!mapMNISTDataset(imageFile, labelFile, &trainDataset)) {
+        printf("Failed to load training data. Check that files exist in the data/ directory.\n");
+        return 1;
+    }
+    printf("Loaded %u training images\n", trainDataset.numImages);
+
+    uint32_t begin = (uint32_t)((uint64_t)trainDataset.numImages * shardIndex / numShards);
+    uint32_t end = (uint32_t)((uint64_t)trainDataset.numImages * (shardIndex + 1) / numShards);
+    MNISTDataset shard = sliceMNISTDataset(&trainDataset, begin, end);
+    if (numShards > 1) {
+        printf("Training shard %d/%d: images %u to %u\n", shardIndex, numShards, begin, end - 1);
+    }
+
+    if (recognizeLetters) {
+        adjustLabels(&shard);
+    }
+
+    int numFeatures = (trainDataset.rows/cellSize) * (trainDataset.cols/cellSize) * numBins;
+    if (!initNaiveBayes(&model, numClasses, numFeatures, numBins, 1.0)) {
+        printf("Failed to initialize Naive Bayes model\n");
+        freeMNISTDataset(&trainDataset);
+        return 1;
+    }
+
+    // Extract and count in one pass; the feature matrix is never stored. The
+    // interactive recognizer draws upright characters, so EMNIST letters need
+    // the same orientation transform it applies when training itself.
+    printf("Extracting HOG features and training...\n");
+    int ok = (recognizeLetters ? trainUprightLetters(&model, &shard, cellSize, numBins) :
+                                 trainNaiveBayesFromDataset(&model, &shard, cellSize, numBins, 0)) &&
+             saveNaiveBayes(&model, modelFile, cellSize, numBins);
+
+    freeMNISTDataset(&trainDataset);
+    freeNaiveBayes(&model);
+
+    return ok ? 0 : 1;
+}
+
+// Add up the counts of models trained on separate shards and save the result
+int mergeModels(const char *outputFile, char **inputFiles, int numInputs,
+                int cellSize, int numBins) {
+    NaiveBayesModel merged, part;
+
+    if (!loadNaiveBayes(&merged, inputFiles[0], cellSize, numBins)) {
+        return 1;
+    }
+    for (int i = 1; i < numInputs; i++) {
+        if (!loadNaiveBayes(&part, inputFiles[i], cellSize, numBins)) {
+            freeNaiveBayes(&merged);
+            return 1;
+        }
+        int ok = mergeNaiveBayes(&merged, &part);
+        freeNaiveBayes(&part);
+        if (!ok) {
+            freeNaiveBayes(&merged);
+            return 1;
+        }
+    }
+
+    printf("Merged %d models: %llu training images\n", numInputs, (unsigned long long)merged.numImages);
+    int ok = saveNaiveBayes(&merged, outputFile, cellSize, numBins);
+    freeNaiveBayes(&merged);
+    return ok ? 0 : 1;
+}
+
+// Label as printed: a letter for the 26-class letters model, else a digit
+static char classToChar(int numClasses, uint8_t label) {
+    return numClasses == 26 ? labelToChar(label + 1) : (char)('0' + label);
+}
+
+// Classify the first count test images one at a time with a saved model,
+// the way the interactive recognizer and other single-image callers do,
+// and report each image's top classes and the time per image
+int classifyTestImages(const char *modelFile, uint32_t count, int cellSize, int numBins) {
+    NaiveBayesModel model;
+    MNISTDataset testDataset;
+    ClassifierScratch scratch;
+    ClassifierResult result;
+
+    if (!loadNaiveBayes(&model, modelFile, cellSize, numBins)) {
+        return 1;
+    }
+
+    // Saved letter models are trained on upright images (see trainAndSaveModel)
+    int recognizeLetters = model.numClasses == 26;
+    int loaded = recognizeLetters ?
+        loadEMNISTDataset("data/emnist-letters-test-images-idx3-ubyte",
+                          "data/emnist-letters-test-labels-idx1-ubyte", &testDataset) :
+        loadMNISTDataset("data/t10k-images-idx3-ubyte", "data/t10k-labels-idx1-ubyte", &testDataset);
+    if (!loaded) {
+        printf("Failed to load test data. Check that files exist in the data/ directory.\n");
+        freeNaiveBayes(&model);
+        return 1;
+    }
+    if (recognizeLetters) {
+        adjustLabels(&testDataset);
+    }
+
+    if (!initClassifierScratch(&scratch, &model, testDataset.rows, testDataset.cols, cellSize, numBins)) {
+        freeMNISTDataset(&testDataset);
+        freeNaiveBayes(&model);
+        return 1;
+    }
+
+    if (count > testDataset.numImages) {
+        count = testDataset.numImages;
+    }
+    uint32_t correct = 0;
+    double elapsed = 0.0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t label = testDataset.labels[i];
+        double start = getTimeSeconds();
+        classifyImage(&model, &testDataset.images[(size_t)i * testDataset.imageSize], &scratch, &result);
+        elapsed += getTimeSeconds() - start;
+        correct += result.prediction == label;
+
+        printf("Image %u: actual %c, predicted %c  [", i, classToChar(model.numClasses, label),
+               classToChar(model.numClasses, result.prediction));
+        for (int k = 0; k < result.numTop; k++) {
+            printf("%s%c %.3f", k > 0 ? ", " : "", classToChar(model.numClasses, result.topClasses[k]),
+                   result.topConfidences[k]);
+        }
+        printf("]\n");
+    }
+    if (count > 0) {
+        printf("Classified %u images: %.2f%% correct, %.1f us per image\n",
+               count, 100.0 * correct / count, 1e6 * elapsed / count);
+    }
+
+    freeClassifierScratch(&scratch);
+    freeMNISTDataset(&testDataset);
+    freeNaiveBayes(&model);
+    return 0;
+}
+
+// Extract the HOG features of a loaded dataset. With a cacheDir (not NULL)
+// the dataset isn't loaded: the features of the IDX file pair come from the
+// cache, and the files are only read on a miss.
+int extractFeatures(const char *cacheDir, const char *imageFile, const char *labelFile,
+                    MNISTDataset *dataset, HOGFeatures *hogFeatures,
+                    int cellSize, int numBins, HOGStorage storage, int modelBins) {
+    if (cacheDir != NULL) {
+        return loadHOGFeaturesCached(cacheDir, imageFile, labelFile, HOG_CACHE_ZERO_BASED_LABELS,
+                                     cellSize, numBins, storage, modelBins, 0, hogFeatures);
+    }
+    hogFeatures->numImages = dataset->numImages;
+    hogFeatures->numFeatures = (dataset->rows/cellSize) * (dataset->cols/cellSize) * numBins;
+    extractHOGFeaturesAs(dataset, hogFeatures, cellSize, numBins, storage, modelBins, 0);
+    return 1;
+}
+
+// How the evaluation run trains its model
+typedef enum {
+    TRAINING_BATCH,   // Extract all training features, then count them
+    TRAINING_FUSED,   // Count each image's features as they are extracted
+    TRAINING_STREAM   // Like fused, reading the training files batch by batch
+} TrainingMode;
+
+// Train on an IDX file pair read in batches; at most two batches of images
+// are held in memory at a time
+int trainFromStream(NaiveBayesModel *model, const char *imageFile, const char *labelFile,
+                    int cellSize, int numBins) {
+    IDXStream stream;
+    MNISTDataset batch;
+    NaiveBayesTrainer trainer;
+
+    if (!openIDXStream(imageFile, labelFile, TRAIN_BATCH_SIZE, &stream)) {
+        return 0;
+    }
+    if (!beginNaiveBayesTraining(&trainer, model, cellSize, numBins, 0)) {
+        closeIDXStream(&stream);
+        return 0;
+    }
+
+    while (nextIDXBatch(&stream, &batch)) {
+        // Make 1-26 into 0-25, as adjustLabels does for whole datasets
+        for (uint32_t i = 0; i < batch.numImages; i++) {
+            if (batch.labels[i] > 0) {
+                batch.labels[i] -= 1;
+            }
+        }
+        addNaiveBayesTrainingImages(&trainer, &batch);
+    }
+    printf("Streamed %u training letter images\n", trainer.numImages);
+
+    int ok = finishNaiveBayesTraining(&trainer) && !stream.readFailed;
+    closeIDXStream(&stream);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
     MNISTDataset trainDataset, testDataset;
     HOGFeatures trainHOG, testHOG;
     NaiveBayesModel model;
     
     int cellSize = 4;
     int numBins = 9;
+    int modelBins = 32;
     int numClasses = 26; // 26 letters (A-Z)
+    HOGStorage storage = HOG_STORAGE_BINNED;
+    TrainingMode training = TRAINING_BATCH;
+    int mapDatasets = 1;
+    const char *cacheDir = NULL;
+    int shardIndex = 0, numShards = 1;
 
-    // Load training data
-    printf("Loading EMNIST letter training data...\n");
-    if (!loadMNISTDataset("data/emnist-letters-train-images-idx3-ubyte", 
-                          "data/emnist-letters-train-labels-idx1-ubyte", 
-                          &trainDataset)) {
-        printf("Failed to load training data. Check that files exist in the data/ directory.\n");
+    // "--threads N" sets the worker count for the parallel stages,
+    // "--gradient direct|lut|simd" how HOG computes pixel gradients,
+    // "--storage double|float|binned" how extracted features are kept in memory,
+    // "--training batch|fused|stream" whether training extracts all features first,
+    // "--dataset read|map" whether the IDX files are read into memory or mapped,
+    // "--cache DIR" where extracted HOG features are cached between runs,
+    // "--shard I/N" makes train use only the I-th (0-based) of N slices of the data
+    int argi = 1;
+    while (argi + 1 < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if (strcmp(argv[argi], "--threads") == 0) {
+            setDefaultThreadCount(atoi(argv[argi + 1]));
+        } else if (strcmp(argv[argi], "--gradient") == 0 && strcmp(argv[argi + 1], "direct") == 0) {
+            setHOGGradientMethod(HOG_GRADIENT_DIRECT);
+        } else if (strcmp(argv[argi], "--gradient") == 0 && strcmp(argv[argi + 1], "lut") == 0) {
+            setHOGGradientMethod(HOG_GRADIENT_LUT);
+        } else if (strcmp(argv[argi], "--gradient") == 0 && strcmp(argv[argi + 1], "simd") == 0) {
+            setHOGGradientMethod(HOG_GRADIENT_SIMD);
+        } else if (strcmp(argv[argi], "--storage") == 0 && strcmp(argv[argi + 1], "double") == 0) {
+            storage = HOG_STORAGE_DOUBLE;
+        } else if (strcmp(argv[argi], "--storage") == 0 && strcmp(argv[argi + 1], "float") == 0) {
+            storage = HOG_STORAGE_FLOAT;
+        } else if (strcmp(argv[argi], "--storage") == 0 && strcmp(argv[argi + 1], "binned") == 0) {
+            storage = HOG_STORAGE_BINNED;
+        } else if (strcmp(argv[argi], "--training") == 0 && strcmp(argv[argi + 1], "batch") == 0) {
+            training = TRAINING_BATCH;
+        } else if (strcmp(argv[argi], "--training") == 0 && strcmp(argv[argi + 1], "fused") == 0) {
+            training = TRAINING_FUSED;
+        } else if (strcmp(argv[argi], "--training") == 0 && strcmp(argv[argi + 1], "stream") == 0) {
+            training = TRAINING_STREAM;
+        } else if (strcmp(argv[argi], "--dataset") == 0 && strcmp(argv[argi + 1], "read") == 0) {
+            mapDatasets = 0;
+        } else if (strcmp(argv[argi], "--dataset") == 0 && strcmp(argv[argi + 1], "map") == 0) {
+            mapDatasets = 1;
+        } else if (strcmp(argv[argi], "--cache") == 0) {
+            cacheDir = argv[argi + 1];
+        } else if (strcmp(argv[argi], "--shard") == 0 &&
+                   sscanf(argv[argi + 1], "%d/%d", &shardIndex, &numShards) == 2 &&
+                   numShards > 0 && shardIndex >= 0 && shardIndex < numShards) {
+            // Parsed by sscanf
+        } else {
+            break;
+        }
+        argi += 2;
+    }
+
+    // "train [digits|letters] FILE" trains once and saves the model for the interactive recognizer,
+    // "merge OUTPUT INPUT..." combines models trained on separate shards,
+    // "classify MODEL_FILE [COUNT]" runs a saved model on single test images
+    if (argi < argc) {
+        if (strcmp(argv[argi], "train") == 0 && argc - argi == 3 &&
+            (strcmp(argv[argi + 1], "digits") == 0 || strcmp(argv[argi + 1], "letters") == 0)) {
+            return trainAndSaveModel(strcmp(argv[argi + 1], "letters") == 0, argv[argi + 2],
+                                     cellSize, numBins, shardIndex, numShards);
+        }
+        if (strcmp(argv[argi], "merge") == 0 && argc - argi >= 3) {
+            return mergeModels(argv[argi + 1], &argv[argi + 2], argc - argi - 2, cellSize, numBins);
+        }
+        if (strcmp(argv[argi], "classify") == 0 && (argc - argi == 2 || argc - argi == 3)) {
+            uint32_t count = argc - argi == 3 ? (uint32_t)atoi(argv[argi + 2]) : 10;
+            return classifyTestImages(argv[argi + 1], count, cellSize, numBins);
+        }
+        printf("Usage: %s [--threads N] [--gradient direct|lut|simd] [--storage double|float|binned] [--training batch|fused|stream] [--dataset read|map] [--cache DIR] [--shard I/N]\n"
+               "          [train digits|letters MODEL_FILE | merge OUTPUT_MODEL INPUT_MODEL... | classify MODEL_FILE [COUNT]]\n", argv[0]);
         return 1;
     }
-    printf("Loaded %u training letter images\n", trainDataset.numImages);
+
+    // Mapped datasets are paged in as HOG extraction walks them, and are
+    // shared with any other process using the same files
+    int (*loadDataset)(const char*, const char*, MNISTDataset*) =
+        mapDatasets ? mapMNISTDataset : loadMNISTDataset;
+
+    const char *trainImageFile = "data/emnist-letters-train-images-idx3-ubyte";
+    const char *trainLabelFile = "data/emnist-letters-train-labels-idx1-ubyte";
+    const char *testImageFile = "data/emnist-letters-test-images-idx3-ubyte";
+    const char *testLabelFile = "data/emnist-letters-test-labels-idx1-ubyte";
+
+    // Cached features stand in for the images wherever only features are
+    // needed: the test set, and the training set unless training is fused.
+    // Streamed training reads its data later, batch by batch.
+    int loadTrainImages = training == TRAINING_FUSED || (training == TRAINING_BATCH && cacheDir == NULL);
+    int loadTestImages = cacheDir == NULL;
+
+    // Load training data
+    if (loadTrainImages) {
+        printf("Loading EMNIST letter training data...\n");
+        if (!loadDataset(trainImageFile, trainLabelFile, &trainDataset)) {
+            printf("Failed to load training data. Check that files exist in the data/ directory.\n");
+            return 1;
+        }
+        printf("Loaded %u training letter images\n", trainDataset.numImages);
+    }
     
     // Load test data
-    printf("Loading EMNIST letter test data...\n");
-    if (!loadMNISTDataset("data/emnist-letters-test-images-idx3-ubyte", 
-                          "data/emnist-letters-test-labels-idx1-ubyte", 
-                          &testDataset)) {
-        printf("Failed to load test data. Check that files exist in the data/ directory.\n");
-        freeMNISTDataset(&trainDataset);
-        return 1;
+    if (loadTestImages) {
+        printf("Loading EMNIST letter test data...\n");
+        if (!loadDataset(testImageFile, testLabelFile, &testDataset)) {
+            printf("Failed to load test data. Check that files exist in the data/ directory.\n");
+            if (loadTrainImages) {
+                freeMNISTDataset(&trainDataset);
+            }
+            return 1;
+        }
+        printf("Loaded %u test letter images\n", testDataset.numImages);
     }
-    printf("Loaded %u test letter images\n", testDataset.numImages);
 
     // Adjust labels to be 0-based for our model
-    adjustLabels(&trainDataset);
-    adjustLabels(&testDataset);
-
-    // Initialize HOG feature structures
-    trainHOG.numImages = trainDataset.numImages;
-    trainHOG.numFeatures = (trainDataset.rows/cellSize) * (trainDataset.cols/cellSize) * numBins;
-    
-    testHOG.numImages = testDataset.numImages;
-    testHOG.numFeatures = (testDataset.rows/cellSize) * (testDataset.cols/cellSize) * numBins;
+    if (loadTrainImages) {
+        adjustLabels(&trainDataset);
+    }
+    if (loadTestImages) {
+        adjustLabels(&testDataset);
+    }
 
     // Extract HOG features
-    printf("Extracting HOG features from training letters...\n");
-    extractHOGFeatures(&trainDataset, &trainHOG, cellSize, numBins);
+    if (training == TRAINING_BATCH) {
+        printf("Extracting HOG features from training letters...\n");
+        if (!extractFeatures(cacheDir, trainImageFile, trainLabelFile, &trainDataset, &trainHOG,
+                             cellSize, numBins, storage, modelBins)) {
+            printf("Failed to extract training features\n");
+            return 1;
+        }
+    }
 
     printf("Extracting HOG features from test letters...\n");
-    extractHOGFeatures(&testDataset, &testHOG, cellSize, numBins);
+    if (!extractFeatures(cacheDir, testImageFile, testLabelFile, &testDataset, &testHOG,
+                         cellSize, numBins, storage, modelBins)) {
+        printf("Failed to extract test features\n");
+        return 1;
+    }
 
     // Initialize and train the model
     printf("Training letter recognition model...\n");
-    if (!initNaiveBayes(&model, numClasses, trainHOG.numFeatures, 32, 1.0)) {
+    if (!initNaiveBayes(&model, numClasses, testHOG.numFeatures, modelBins, 1.0)) {
         printf("Failed to initialize Naive Bayes model\n");
         return 1;
     }
     
-    trainNaiveBayes(&model, &trainHOG);
+    if (training == TRAINING_STREAM) {
+        if (!trainFromStream(&model, trainImageFile, trainLabelFile, cellSize, numBins)) {
+            printf("Failed to train from the streamed training data\n");
+            return 1;
+        }
+    } else if (training == TRAINING_FUSED) {
+        trainNaiveBayesFromDataset(&model, &trainDataset, cellSize, numBins, 0);
+    } else {
+        trainNaiveBayes(&model, &trainHOG);
+        freeHOGFeatures(&trainHOG);
+    }
     
     // Test the model
     printf("Testing the letter recognition model...\n");
-    int correct = 0;
     int confusionMatrix[26][26] = {0}; // Track misclassifications
     
-    for (uint32_t i = 0; i < testHOG.numImages; i++) {
-        double *features = &testHOG.features[i * testHOG.numFeatures];
-        uint8_t prediction = predictNaiveBayes(&model, features);
-        uint8_t actual = testHOG.labels[i];
-        
-        // Update confusion matrix (now with 0-based labels)
-        if (actual < 26 && prediction < 26) {
-            confusionMatrix[actual][prediction]++;
-        }
-        
-        if (prediction == actual) {
-            correct++;
-        }
-        
-        // Print progress
-        if ((i + 1) % 1000 == 0 || i + 1 == testHOG.numImages) {
-            printf("Progress: %u/%u, Accuracy: %.2f%%\n", 
-                   i + 1, testHOG.numImages, 
-                   100.0 * correct / (i + 1));
-        }
-    }
+    // Predict the whole test set across worker threads; each worker keeps its
+    // own confusion-matrix shard and the shards are merged at the end
+    double start = getTimeSeconds();
+    uint32_t correct = evaluateNaiveBayesBatch(&model, &testHOG, &confusionMatrix[0][0]);
+    double elapsed = getTimeSeconds() - start;
+    
+    printf("Evaluated %u images in %.3f s (%.0f images/sec, %d threads)\n",
+           testHOG.numImages, elapsed, testHOG.numImages / elapsed,
+           parallelWorkerCount(testHOG.numImages, 0));
     
     // Final accuracy
     double accuracy = 100.0 * correct / testHOG.numImages;
@@ -162,9 +508,12 @@ int main() {
     }
     
     // Free memory
-    freeMNISTDataset(&trainDataset);
-    freeMNISTDataset(&testDataset);
-    freeHOGFeatures(&trainHOG);
+    if (loadTrainImages) {
+        freeMNISTDataset(&trainDataset);
+    }
+    if (loadTestImages) {
+        freeMNISTDataset(&testDataset);
+    }
     freeHOGFeatures(&testHOG);
     freeNaiveBayes(&model);
     
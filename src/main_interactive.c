@@ -5,9 +5,16 @@
 #include "mnist_loader.h"
 #include "hog.h"
 #include "naive_bayes.h"
+#include "feature_cache.h"
 #include "utils.h"
 #include "ui_drawer.h"
 
+// Frame period of the main loop (~60 FPS)
+#define FRAME_MS 16
+
+// Longest an idle main loop sleeps between checks for input
+#define IDLE_WAIT_MS 500
+
 // Function to adjust dataset labels to be 0-based
 void adjustLabels(MNISTDataset *dataset) {
     printf("Adjusting labels to be 0-based...\n");
@@ -22,25 +29,39 @@ int main(int argc, char *argv[]) {
     // Determine if we're recognizing digits or letters
     int recognizeLetters = 1;  // Default to letters
     
+    // Optional saved model (see "mnist_classifier train") to skip training at startup
+    const char *modelFile = NULL;
+
+    // "--cache DIR" keeps the extracted training features in DIR, so later
+    // runs that train at startup map them instead of extracting them again
+    const char *cacheDir = NULL;
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "--cache") == 0) {
+        cacheDir = argv[argi + 1];
+        argi += 2;
+    }
+
     // Check command line arguments
-    if (argc > 1) {
-        if (strcmp(argv[1], "digits") == 0) {
+    if (argi < argc) {
+        if (strcmp(argv[argi], "digits") == 0) {
             recognizeLetters = 0;
-        } else if (strcmp(argv[1], "letters") == 0) {
+        } else if (strcmp(argv[argi], "letters") == 0) {
             recognizeLetters = 1;
         } else {
-            printf("Usage: %s [digits|letters]\n", argv[0]);
+            printf("Usage: %s [--cache DIR] [digits|letters] [MODEL_FILE]\n", argv[0]);
             return 1;
         }
     }
+    if (argi + 1 < argc) {
+        modelFile = argv[argi + 1];
+    }
     
     MNISTDataset trainDataset;
-    HOGFeatures trainHOG;
     NaiveBayesModel model;
     
-    // IMPORTANT: These parameters must match those in ui_drawer.c
-    int cellSize = 4;  // MAKE SURE THIS MATCHES THE CELL_SIZE IN ui_drawer.c
-    int numBins = 9;
+    // Train with the same HOG parameters the recognizer extracts (ui_drawer.h)
+    int cellSize = CELL_SIZE;
+    int numBins = NUM_BINS;
     int numClasses = recognizeLetters ? 26 : 10;  // 26 for letters, 10 for digits
     
     // Set file paths based on what we're recognizing
@@ -55,46 +76,83 @@ int main(int argc, char *argv[]) {
         printf("Running digit recognizer\n");
     }
 
-    // Load training data
-    printf("Loading training data...\n");
-    if (recognizeLetters) {
-        // Use EMNIST-specific loader for letters
-        if (!loadEMNISTDataset(imageFile, labelFile, &trainDataset)) {
-            printf("Failed to load training data. Check that files exist in the data/ directory.\n");
+    if (modelFile != NULL) {
+        // A saved model must have been trained with the same HOG parameters as ui_drawer.c.
+        // Mapping it lets every recognizer on the host share one copy of the tables.
+        printf("Loading model from %s...\n", modelFile);
+        if (!mapNaiveBayes(&model, modelFile, cellSize, numBins)) {
+            printf("Failed to load model from %s\n", modelFile);
             return 1;
         }
-    } else {
-        // Use standard loader for digits
-        if (!loadMNISTDataset(imageFile, labelFile, &trainDataset)) {
+        if (model.numClasses != numClasses) {
+            printf("ERROR: Model %s has %d classes but the %s recognizer needs %d\n",
+                   modelFile, model.numClasses, recognizeLetters ? "letter" : "digit", numClasses);
+            freeNaiveBayes(&model);
+            return 1;
+        }
+        printf("Model loaded and ready!\n");
+    } else if (cacheDir != NULL) {
+        // Extract HOG features as the value bins the model trains on, or map
+        // them from the cache when an earlier run extracted the same files
+        HOGFeatures trainHOG;
+        printf("Extracting HOG features...\n");
+        uint32_t flags = recognizeLetters ? HOG_CACHE_EMNIST_TRANSFORM | HOG_CACHE_ZERO_BASED_LABELS : 0;
+        if (!loadHOGFeaturesCached(cacheDir, imageFile, labelFile, flags, cellSize, numBins,
+                                   HOG_STORAGE_BINNED, numBins, 0, &trainHOG)) {
             printf("Failed to load training data. Check that files exist in the data/ directory.\n");
             return 1;
         }
-    }
-    printf("Loaded %u training images\n", trainDataset.numImages);
-    
-    // Adjust labels for letters (they're 1-indexed in EMNIST)
-    if (recognizeLetters) {
-        adjustLabels(&trainDataset);
-    }
 
-    // Initialize HOG feature structure
-    trainHOG.numImages = trainDataset.numImages;
-    trainHOG.numFeatures = (trainDataset.rows/cellSize) * (trainDataset.cols/cellSize) * numBins;
-    
-    // Extract HOG features
-    printf("Extracting HOG features...\n");
-    extractHOGFeatures(&trainDataset, &trainHOG, cellSize, numBins);
+        printf("Training model (this might take a minute)...\n");
+        if (!initNaiveBayes(&model, numClasses, trainHOG.numFeatures, numBins, 1.0)) {
+            printf("Failed to initialize Naive Bayes model\n");
+            freeHOGFeatures(&trainHOG);
+            return 1;
+        }
+        trainNaiveBayes(&model, &trainHOG);
+        printf("Model trained and ready!\n");
+        freeHOGFeatures(&trainHOG);
+    } else {
+        // Load training data
+        printf("Loading training data...\n");
+        if (recognizeLetters) {
+            // Use EMNIST-specific loader for letters
+            if (!loadEMNISTDataset(imageFile, labelFile, &trainDataset)) {
+                printf("Failed to load training data. Check that files exist in the data/ directory.\n");
+                return 1;
+            }
+        } else {
+            // Use standard loader for digits
+            if (!loadMNISTDataset(imageFile, labelFile, &trainDataset)) {
+                printf("Failed to load training data. Check that files exist in the data/ directory.\n");
+                return 1;
+            }
+        }
+        printf("Loaded %u training images\n", trainDataset.numImages);
+        
+        // Adjust labels for letters (they're 1-indexed in EMNIST)
+        if (recognizeLetters) {
+            adjustLabels(&trainDataset);
+        }
 
-    // Initialize and train the model
-    printf("Training model (this might take a minute)...\n");
-    if (!initNaiveBayes(&model, numClasses, trainHOG.numFeatures, numBins, 1.0)) {
-        printf("Failed to initialize Naive Bayes model\n");
-        return 1;
+        // Initialize and train the model; HOG features are counted as they
+        // are extracted, so the full feature matrix is never held in memory
+        int numFeatures = (trainDataset.rows/cellSize) * (trainDataset.cols/cellSize) * numBins;
+        printf("Training model (this might take a minute)...\n");
+        if (!initNaiveBayes(&model, numClasses, numFeatures, numBins, 1.0)) {
+            printf("Failed to initialize Naive Bayes model\n");
+            return 1;
+        }
+        
+        if (!trainNaiveBayesFromDataset(&model, &trainDataset, cellSize, numBins, 0)) {
+            return 1;
+        }
+        printf("Model trained and ready!\n");
+
+        // Training data is no longer needed once the model is built
+        freeMNISTDataset(&trainDataset);
     }
     
-    trainNaiveBayes(&model, &trainHOG);
-    printf("Model trained and ready!\n");
-    
     // Load reference samples for visualization
     printf("Loading reference samples for visualization...\n");
     if (!loadReferenceSamples(imageFile, labelFile)) {
@@ -108,20 +166,32 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    // Main loop
+    // Main loop, paced to a fixed frame deadline. Predictions run on the
+    // worker thread, so a frame only ever spends time on events and drawing,
+    // and frames where nothing changed skip drawing too.
     int running = 1;
+    Uint32 nextFrame = SDL_GetTicks();
     while (running) {
+        // Nothing to draw or wait for: sleep until the next input instead of polling
+        if (isUIIdle(&ui)) {
+            SDL_WaitEventTimeout(NULL, IDLE_WAIT_MS);
+            nextFrame = SDL_GetTicks();
+        }
         running = processEvents(&ui);
         renderUI(&ui);
         
-        // Cap to ~60 FPS
-        SDL_Delay(16);
+        // Sleep until the next ~60 FPS frame is due
+        nextFrame += FRAME_MS;
+        Uint32 now = SDL_GetTicks();
+        if ((Sint32)(nextFrame - now) > 0) {
+            SDL_Delay(nextFrame - now);
+        } else {
+            nextFrame = now;  // Fell behind; don't try to catch up
+        }
     }
     
     // Clean up
     cleanupUI(&ui);
-    freeMNISTDataset(&trainDataset);
-    freeHOGFeatures(&trainHOG);
     freeNaiveBayes(&model);
     
     return 0;
@@ -2,38 +2,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "mnist_loader.h"
+#include "parallel.h"
 #include "utils.h"
 
+// Open an IDX file for reading. zlib checks the gzip magic bytes and
+// decompresses on the fly, passing uncompressed files through unchanged. If
+// the file doesn't exist, the compressed FILENAME.gz the datasets ship as is
+// tried instead.
+static gzFile openIDXFile(const char *filename) {
+    gzFile file = gzopen(filename, "rb");
+    if (file == NULL) {
+        char gzName[strlen(filename) + 4];
+        snprintf(gzName, sizeof(gzName), "%s.gz", filename);
+        file = gzopen(gzName, "rb");
+    }
+    if (file != NULL) {
+        gzbuffer(file, 1 << 18);  // Fewer, larger reads from disk
+    }
+    return file;
+}
+
+// Read exactly size bytes; gzread counts in unsigned ints, so go in chunks
+static int readIDXBytes(gzFile file, void *buffer, size_t size) {
+    uint8_t *dst = (uint8_t*)buffer;
+    while (size > 0) {
+        unsigned chunk = size > (1u << 30) ? (1u << 30) : (unsigned)size;
+        if (gzread(file, dst, chunk) != (int)chunk) {
+            return 0;
+        }
+        dst += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+
 // Function to load an MNIST dataset
 int loadMNISTDataset(const char *imageFilename, const char *labelFilename, MNISTDataset *dataset) {
-    FILE *imageFile, *labelFile;
-    uint32_t imageMagic, labelMagic, numLabels;
+    gzFile imageFile, labelFile;
+    uint32_t imageMagic = 0, labelMagic = 0, numLabels = 0;
+    
+    dataset->imageMapping = NULL;
     
     // Open the image file
-    imageFile = fopen(imageFilename, "rb");
+    imageFile = openIDXFile(imageFilename);
     if (imageFile == NULL) {
         perror("Error opening image file");
         return 0;
     }
     
     // Open the label file
-    labelFile = fopen(labelFilename, "rb");
+    labelFile = openIDXFile(labelFilename);
     if (labelFile == NULL) {
         perror("Error opening label file");
-        fclose(imageFile);
+        gzclose(imageFile);
         return 0;
     }
     
     // Read image header
-    fread(&imageMagic, sizeof(imageMagic), 1, imageFile);
-    fread(&dataset->numImages, sizeof(dataset->numImages), 1, imageFile);
-    fread(&dataset->rows, sizeof(dataset->rows), 1, imageFile);
-    fread(&dataset->cols, sizeof(dataset->cols), 1, imageFile);
+    readIDXBytes(imageFile, &imageMagic, sizeof(imageMagic));
+    readIDXBytes(imageFile, &dataset->numImages, sizeof(dataset->numImages));
+    readIDXBytes(imageFile, &dataset->rows, sizeof(dataset->rows));
+    readIDXBytes(imageFile, &dataset->cols, sizeof(dataset->cols));
     
     // Read label header
-    fread(&labelMagic, sizeof(labelMagic), 1, labelFile);
-    fread(&numLabels, sizeof(numLabels), 1, labelFile);
+    readIDXBytes(labelFile, &labelMagic, sizeof(labelMagic));
+    readIDXBytes(labelFile, &numLabels, sizeof(numLabels));
     
     // Convert headers from big-endian
     imageMagic = convert_endian(imageMagic);
@@ -47,16 +87,16 @@ int loadMNISTDataset(const char *imageFilename, const char *labelFilename, MNIST
     // Verify the magic numbers
     if (imageMagic != 2051 || labelMagic != 2049) {
         printf("Invalid file format\n");
-        fclose(imageFile);
-        fclose(labelFile);
+        gzclose(imageFile);
+        gzclose(labelFile);
         return 0;
     }
     
     // Check if the number of images matches the number of labels
     if (dataset->numImages != numLabels) {
         printf("Number of images doesn't match number of labels\n");
-        fclose(imageFile);
-        fclose(labelFile);
+        gzclose(imageFile);
+        gzclose(labelFile);
         return 0;
     }
     
@@ -64,52 +104,313 @@ int loadMNISTDataset(const char *imageFilename, const char *labelFilename, MNIST
     dataset->imageSize = dataset->rows * dataset->cols;
     
     // Allocate memory for images and labels
-    dataset->images = (uint8_t*)malloc(dataset->numImages * dataset->imageSize);
+    dataset->images = (uint8_t*)malloc((size_t)dataset->numImages * dataset->imageSize);
     dataset->labels = (uint8_t*)malloc(dataset->numImages);
     
     if (dataset->images == NULL || dataset->labels == NULL) {
         printf("Memory allocation failed\n");
-        fclose(imageFile);
-        fclose(labelFile);
+        gzclose(imageFile);
+        gzclose(labelFile);
         free(dataset->images);  // Safe to call free on NULL
         free(dataset->labels);
         return 0;
     }
     
-    // Read all images
-    if (fread(dataset->images, 1, dataset->numImages * dataset->imageSize, imageFile) != 
-        dataset->numImages * dataset->imageSize) {
+    // Read (or decompress) all images straight into the dataset buffer
+    if (!readIDXBytes(imageFile, dataset->images, (size_t)dataset->numImages * dataset->imageSize)) {
         printf("Failed to read all image data\n");
-        fclose(imageFile);
-        fclose(labelFile);
+        gzclose(imageFile);
+        gzclose(labelFile);
         free(dataset->images);
         free(dataset->labels);
         return 0;
     }
     
     // Read all labels
-    if (fread(dataset->labels, 1, dataset->numImages, labelFile) != dataset->numImages) {
+    if (!readIDXBytes(labelFile, dataset->labels, dataset->numImages)) {
         printf("Failed to read all label data\n");
-        fclose(imageFile);
-        fclose(labelFile);
+        gzclose(imageFile);
+        gzclose(labelFile);
         free(dataset->images);
         free(dataset->labels);
         return 0;
     }
     
     // Close files
-    fclose(imageFile);
-    fclose(labelFile);
+    gzclose(imageFile);
+    gzclose(labelFile);
     
     return 1;  // Success
 }
 
+// Map a whole uncompressed IDX file read-only and hint that it will be read
+// front to back. Returns NULL if the file is missing, compressed or can't be mapped.
+static void *mapIDXFile(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 2) {
+        close(fd);
+        return NULL;
+    }
+
+    // Read-only, so the pages stay the page cache's and are shared with every
+    // other process using the file; nothing can dirty them into private copies
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    // A gzip file has to be decompressed, so it can't be used in place
+    const uint8_t *magic = (const uint8_t*)mapping;
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return mapping;
+}
+
+// Read big-endian header field i of a mapped IDX file
+static uint32_t idxHeaderField(const void *mapping, int i) {
+    uint32_t value;
+    memcpy(&value, (const uint8_t*)mapping + i * sizeof(uint32_t), sizeof(value));
+    return convert_endian(value);
+}
+
+// Function to map an MNIST dataset
+int mapMNISTDataset(const char *imageFilename, const char *labelFilename, MNISTDataset *dataset) {
+    size_t imageFileSize, labelFileSize;
+    void *imageMapping = mapIDXFile(imageFilename, &imageFileSize);
+    void *labelMapping = mapIDXFile(labelFilename, &labelFileSize);
+
+    // Compressed or missing files go through the reading loader, which
+    // decompresses them or reports the error
+    if (imageMapping == NULL || labelMapping == NULL) {
+        if (imageMapping != NULL) {
+            munmap(imageMapping, imageFileSize);
+        }
+        if (labelMapping != NULL) {
+            munmap(labelMapping, labelFileSize);
+        }
+        return loadMNISTDataset(imageFilename, labelFilename, dataset);
+    }
+
+    // Image header: magic, count, rows, cols; label header: magic, count
+    if (imageFileSize < 4 * sizeof(uint32_t) || labelFileSize < 2 * sizeof(uint32_t) ||
+        idxHeaderField(imageMapping, 0) != 2051 || idxHeaderField(labelMapping, 0) != 2049) {
+        printf("Invalid file format\n");
+        munmap(imageMapping, imageFileSize);
+        munmap(labelMapping, labelFileSize);
+        return 0;
+    }
+
+    dataset->numImages = idxHeaderField(imageMapping, 1);
+    dataset->rows = idxHeaderField(imageMapping, 2);
+    dataset->cols = idxHeaderField(imageMapping, 3);
+    dataset->imageSize = dataset->rows * dataset->cols;
+
+    // Check if the number of images matches the number of labels
+    if (dataset->numImages != idxHeaderField(labelMapping, 1)) {
+        printf("Number of images doesn't match number of labels\n");
+        munmap(imageMapping, imageFileSize);
+        munmap(labelMapping, labelFileSize);
+        return 0;
+    }
+
+    // Both payloads must be complete
+    if (imageFileSize - 4 * sizeof(uint32_t) < (size_t)dataset->numImages * dataset->imageSize ||
+        labelFileSize - 2 * sizeof(uint32_t) < dataset->numImages) {
+        printf("Failed to read all image data\n");
+        munmap(imageMapping, imageFileSize);
+        munmap(labelMapping, labelFileSize);
+        return 0;
+    }
+
+    // Callers adjust labels in place, so they get a private copy; at one byte
+    // per image it costs little next to the images
+    dataset->labels = (uint8_t*)malloc(dataset->numImages);
+    if (dataset->labels == NULL) {
+        printf("Failed to allocate memory for labels\n");
+        munmap(imageMapping, imageFileSize);
+        munmap(labelMapping, labelFileSize);
+        return 0;
+    }
+    memcpy(dataset->labels, (uint8_t*)labelMapping + 2 * sizeof(uint32_t), dataset->numImages);
+    munmap(labelMapping, labelFileSize);
+
+    dataset->images = (uint8_t*)imageMapping + 4 * sizeof(uint32_t);
+    dataset->imageMapping = imageMapping;
+    dataset->imageMappingSize = imageFileSize;
+
+    return 1;  // Success
+}
+
+// Read the batch after stream->nextImage into buffer stream->filling
+static void *readIDXBatch(void *arg) {
+    IDXStream *stream = (IDXStream*)arg;
+    int b = stream->filling;
+    uint32_t count = stream->numImages - stream->nextImage;
+    if (count > stream->batchSize) {
+        count = stream->batchSize;
+    }
+
+    // Decompressing here overlaps with the caller's work on the other buffer
+    if (!readIDXBytes(stream->imageFile, stream->images[b], (size_t)count * stream->imageSize) ||
+        !readIDXBytes(stream->labelFile, stream->labels[b], count)) {
+        stream->readFailed = true;
+        count = 0;
+    }
+    stream->count[b] = count;
+    stream->nextImage += count;
+    return NULL;
+}
+
+// Start filling buffer b with the next batch, on the reader thread if possible
+static void startIDXRead(IDXStream *stream, int b) {
+    stream->filling = b;
+    stream->readAhead = true;
+    stream->readerStarted = pthread_create(&stream->reader, NULL, readIDXBatch, stream) == 0;
+    if (!stream->readerStarted) {
+        readIDXBatch(stream);  // No thread available; read it now instead
+    }
+}
+
+// Wait for the outstanding read to finish
+static void finishIDXRead(IDXStream *stream) {
+    if (stream->readAhead && stream->readerStarted) {
+        pthread_join(stream->reader, NULL);
+    }
+    stream->readAhead = false;
+}
+
+int openIDXStream(const char *imageFilename, const char *labelFilename,
+                  uint32_t batchSize, IDXStream *stream) {
+    uint32_t header[4], labelHeader[2];
+    memset(stream, 0, sizeof(*stream));
+
+    stream->imageFile = openIDXFile(imageFilename);
+    if (stream->imageFile == NULL) {
+        perror("Error opening image file");
+        return 0;
+    }
+    stream->labelFile = openIDXFile(labelFilename);
+    if (stream->labelFile == NULL) {
+        perror("Error opening label file");
+        gzclose(stream->imageFile);
+        stream->imageFile = NULL;
+        return 0;
+    }
+
+    // Headers are big-endian: magic, count, rows, cols / magic, count
+    if (!readIDXBytes(stream->imageFile, header, sizeof(header)) ||
+        !readIDXBytes(stream->labelFile, labelHeader, sizeof(labelHeader)) ||
+        convert_endian(header[0]) != 2051 || convert_endian(labelHeader[0]) != 2049) {
+        printf("Invalid file format\n");
+        closeIDXStream(stream);
+        return 0;
+    }
+
+    stream->numImages = convert_endian(header[1]);
+    stream->rows = convert_endian(header[2]);
+    stream->cols = convert_endian(header[3]);
+    stream->imageSize = stream->rows * stream->cols;
+    stream->batchSize = batchSize > 0 ? batchSize : 1;
+
+    if (stream->numImages != convert_endian(labelHeader[1])) {
+        printf("Number of images doesn't match number of labels\n");
+        closeIDXStream(stream);
+        return 0;
+    }
+
+    for (int b = 0; b < 2; b++) {
+        stream->images[b] = (uint8_t*)malloc((size_t)stream->batchSize * stream->imageSize);
+        stream->labels[b] = (uint8_t*)malloc(stream->batchSize);
+        if (stream->images[b] == NULL || stream->labels[b] == NULL) {
+            printf("Memory allocation failed\n");
+            closeIDXStream(stream);
+            return 0;
+        }
+    }
+
+    startIDXRead(stream, 0);
+    return 1;
+}
+
+int nextIDXBatch(IDXStream *stream, MNISTDataset *batch) {
+    if (!stream->readAhead) {
+        return 0;
+    }
+    finishIDXRead(stream);
+
+    int b = stream->filling;
+    if (stream->readFailed) {
+        printf("Failed to read all image data\n");
+        return 0;
+    }
+    if (stream->count[b] == 0) {
+        return 0;
+    }
+
+    // The other buffer is free again: the caller is done with the previous batch
+    if (stream->nextImage < stream->numImages) {
+        startIDXRead(stream, 1 - b);
+    }
+
+    batch->images = stream->images[b];
+    batch->labels = stream->labels[b];
+    batch->numImages = stream->count[b];
+    batch->rows = stream->rows;
+    batch->cols = stream->cols;
+    batch->imageSize = stream->imageSize;
+    batch->imageMapping = NULL;
+    return 1;
+}
+
+void closeIDXStream(IDXStream *stream) {
+    finishIDXRead(stream);
+    if (stream->imageFile != NULL) {
+        gzclose(stream->imageFile);
+    }
+    if (stream->labelFile != NULL) {
+        gzclose(stream->labelFile);
+    }
+    for (int b = 0; b < 2; b++) {
+        free(stream->images[b]);
+        free(stream->labels[b]);
+        stream->images[b] = NULL;
+        stream->labels[b] = NULL;
+    }
+    stream->imageFile = NULL;
+    stream->labelFile = NULL;
+}
+
 // Function to free the dataset
 void freeMNISTDataset(MNISTDataset *dataset) {
-    free(dataset->images);
+    if (dataset->imageMapping != NULL) {
+        munmap(dataset->imageMapping, dataset->imageMappingSize);
+    } else {
+        free(dataset->images);
+    }
     free(dataset->labels);
     dataset->images = NULL;
     dataset->labels = NULL;
+    dataset->imageMapping = NULL;
+}
+
+static void transformEMNISTWorker(uint32_t begin, uint32_t end, int worker, void *context) {
+    MNISTDataset *dataset = (MNISTDataset*)context;
+    (void)worker;
+
+    for (uint32_t i = begin; i < end; i++) {
+        transformEMNISTImage(&dataset->images[(size_t)i * dataset->imageSize], dataset->rows, dataset->cols);
+    }
 }
 
 // Create a new function in mnist_loader.c for loading EMNIST data specifically
@@ -120,19 +421,26 @@ int loadEMNISTDataset(const char *imageFilename, const char *labelFilename, MNIS
     }
     
     // Then transform each image to correct EMNIST orientation
-    printf("Transforming EMNIST images to standard orientation...\n");
-    for (uint32_t i = 0; i < dataset->numImages; i++) {
-        transformEMNISTImage(&dataset->images[i * dataset->imageSize], dataset->rows, dataset->cols);
-        
-        // Print progress for large datasets
-        if ((i + 1) % 10000 == 0 || i + 1 == dataset->numImages) {
-            printf("Transformed %u/%u images\n", i + 1, dataset->numImages);
-        }
-    }
-    
+    transformEMNISTDataset(dataset);
     return 1;
 }
 
+void transformEMNISTDataset(MNISTDataset *dataset) {
+    // Images are independent, so they are split across worker threads
+    printf("Transforming EMNIST images to standard orientation...\n");
+    parallelFor(dataset->numImages, 0, transformEMNISTWorker, dataset);
+    printf("Transformed %u/%u images\n", dataset->numImages, dataset->numImages);
+}
+
+MNISTDataset sliceMNISTDataset(const MNISTDataset *dataset, uint32_t begin, uint32_t end) {
+    MNISTDataset slice = *dataset;
+    slice.images = &dataset->images[(size_t)begin * dataset->imageSize];
+    slice.labels = dataset->labels != NULL ? &dataset->labels[begin] : NULL;
+    slice.numImages = end - begin;
+    slice.imageMapping = NULL;
+    return slice;
+}
+
 void transformEMNISTImageBetter(uint8_t *src, uint32_t size, uint8_t *dst, int rotationAngle) {
     rotationAngle = rotationAngle % 360;
     if (rotationAngle < 0) rotationAngle += 360;
@@ -164,37 +472,34 @@ void transformEMNISTImageBetter(uint8_t *src, uint32_t size, uint8_t *dst, int r
 }
 
 // Updated transformEMNISTImage function in mnist_loader.c
+//
+// EMNIST stores images transposed. Rotating 90 degrees clockwise and then
+// mirroring horizontally moves pixel (r, c) to (c, r), so a single in-place
+// transpose does both: each pair above the diagonal is swapped with its
+// mirror below it, tile by tile so both rows and columns stay in cache.
+#define TRANSPOSE_TILE 8
+
 void transformEMNISTImage(uint8_t *image, uint32_t rows, uint32_t cols) {
+    (void)cols;
     // Assume square images (e.g., 28x28)
-    uint32_t size = rows;  
-    uint8_t *temp = (uint8_t*)malloc(size * size);
-    if (!temp) {
-        printf("Failed to allocate memory for EMNIST transformation\n");
-        return;
-    }
-    
-    // Rotate image 90 degrees clockwise
-    for (uint32_t r = 0; r < size; r++) {
-        for (uint32_t c = 0; c < size; c++) {
-            temp[c * size + (size - 1 - r)] = image[r * size + c];
-        }
-    }
-    
-    // Copy the rotated result back to the original image
-    memcpy(image, temp, size * size);
-    
-    // Now mirror the image horizontally
-    for (uint32_t r = 0; r < size; r++) {
-        for (uint32_t c = 0; c < size/2; c++) {
-            // Swap pixels across the vertical middle axis
-            uint8_t pixel = image[r * size + c];
-            image[r * size + c] = image[r * size + (size - 1 - c)];
-            image[r * size + (size - 1 - c)] = pixel;
+    uint32_t size = rows;
+
+    for (uint32_t rt = 0; rt < size; rt += TRANSPOSE_TILE) {
+        uint32_t rEnd = rt + TRANSPOSE_TILE < size ? rt + TRANSPOSE_TILE : size;
+        for (uint32_t ct = rt; ct < size; ct += TRANSPOSE_TILE) {
+            uint32_t cEnd = ct + TRANSPOSE_TILE < size ? ct + TRANSPOSE_TILE : size;
+            for (uint32_t r = rt; r < rEnd; r++) {
+                // On a diagonal tile only the pairs above the diagonal are swapped
+                for (uint32_t c = (ct == rt ? r + 1 : ct); c < cEnd; c++) {
+                    uint8_t pixel = image[r * size + c];
+                    image[r * size + c] = image[c * size + r];
+                    image[c * size + r] = pixel;
+                }
+            }
         }
     }
-    
-    free(temp);
 }
+
 // Function to display an image as ASCII art
 void displayMNISTImage(uint8_t *image, uint32_t rows, uint32_t cols) {
     for (uint32_t i = 0; i < rows; i++) {
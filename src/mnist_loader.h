@@ -2,6 +2,12 @@
 #define MNIST_LOADER_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// zlib's gzFile handle, kept opaque so users of this header don't need zlib.h
+struct gzFile_s;
 
 // Structure to hold our dataset
 typedef struct {
@@ -11,12 +17,69 @@ typedef struct {
     uint32_t imageSize;    // Size of each image (rows*cols)
     uint32_t rows;         // Number of rows in each image
     uint32_t cols;         // Number of columns in each image
+    void *imageMapping;    // Mapped image file when images points into it, else NULL
+    size_t imageMappingSize;
 } MNISTDataset;
 
-// Function to load an MNIST dataset
+// Function to load an MNIST dataset. Either file may be gzip-compressed, and
+// FILENAME.gz is used when FILENAME doesn't exist.
 int loadMNISTDataset(const char *imageFilename, const char *labelFilename, 
                     MNISTDataset *dataset);
 
+// Same as loadMNISTDataset, but maps the image file instead of reading it.
+// images point straight at the file payload and are paged in on first touch.
+// The mapping is read-only, so its pages stay shared with every process
+// using the file: images must not be edited in place (transform a copy, as
+// trainAndSaveModel does). labels are a private copy and may be adjusted.
+// Compressed files can't be mapped and are loaded with loadMNISTDataset.
+int mapMNISTDataset(const char *imageFilename, const char *labelFilename,
+                    MNISTDataset *dataset);
+
+// Reads an IDX image/label file pair batchSize images at a time, so datasets
+// larger than memory can be processed. Two buffers alternate: while the
+// caller works on one batch, a background thread reads the next into the other.
+typedef struct {
+    struct gzFile_s *imageFile;  // gzFile, raw or gzip-compressed
+    struct gzFile_s *labelFile;
+    uint32_t numImages;    // Images in the files
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t imageSize;
+    uint32_t batchSize;
+    uint32_t nextImage;    // First image the next read starts at
+    uint8_t *images[2];    // Double buffer, batchSize images each
+    uint8_t *labels[2];
+    uint32_t count[2];     // Images held by each buffer
+    bool readFailed;
+    int filling;           // Buffer the read-ahead thread is filling
+    bool readAhead;        // Whether that read is in flight
+    pthread_t reader;
+    bool readerStarted;    // Whether the read runs on `reader` (else it already ran inline)
+} IDXStream;
+
+// Open an IDX file pair and start reading the first batch
+int openIDXStream(const char *imageFilename, const char *labelFilename,
+                  uint32_t batchSize, IDXStream *stream);
+
+// Hand out the next batch as a dataset view (images, labels, numImages,
+// rows, cols). The view stays valid until the next call and must not be
+// freed. Returns 0 once the files are exhausted or a read fails.
+int nextIDXBatch(IDXStream *stream, MNISTDataset *batch);
+
+// Stop read-ahead and release the stream
+void closeIDXStream(IDXStream *stream);
+
+// Function to load an EMNIST dataset and transform it to upright orientation
+int loadEMNISTDataset(const char *imageFilename, const char *labelFilename,
+                      MNISTDataset *dataset);
+
+// Transform every image of a loaded dataset to upright orientation
+void transformEMNISTDataset(MNISTDataset *dataset);
+
+// View of images [begin, end) of a dataset. It shares the dataset's memory,
+// so it must not be freed and is only valid while the dataset is.
+MNISTDataset sliceMNISTDataset(const MNISTDataset *dataset, uint32_t begin, uint32_t end);
+
 // Function to free the dataset
 void freeMNISTDataset(MNISTDataset *dataset);
 void transformEMNISTImage(uint8_t *image, uint32_t rows, uint32_t cols);
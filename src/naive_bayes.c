@@ -3,192 +3,928 @@
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "naive_bayes.h"
 #include "mnist_loader.h"
+#include "parallel.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define NB_X86_SIMD 1
+#endif
+
+// Compile the scoring kernels for several x86 ISA levels; the best clone is
+// picked at load time, with the default clone as the fallback
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define NB_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define NB_TARGET_CLONES
+#endif
 
 // naive bayes implementation with hog
-static int getHOGBin(double value, double binWidth) {
-    int bin = (int)(value/ binWidth);
-    return (bin >=0) ? (bin < 256 ? bin : 255) : 0;
+// Bins of the numFeatures features of image i, whatever form the features are stored in
+static void getHOGBins(const HOGFeatures *hogFeatures, uint32_t i, int numBins, uint8_t *bins) {
+    size_t offset = (size_t)i * hogFeatures->numFeatures;
+    for (uint32_t f = 0; f < hogFeatures->numFeatures; f++) {
+        if (hogFeatures->storage == HOG_STORAGE_BINNED) {
+            bins[f] = hogFeatures->bins[offset + f];
+        } else if (hogFeatures->storage == HOG_STORAGE_FLOAT) {
+            bins[f] = (uint8_t)hogValueBin(hogFeatures->featuresFloat[offset + f], numBins);
+        } else {
+            bins[f] = (uint8_t)hogValueBin(hogFeatures->features[offset + f], numBins);
+        }
+    }
 }
 
-bool initNaiveBayes(NaiveBayesModel *model, int numClasses, int numFeatures, int numBins, double alpha) {
+// Pre-binned features are only usable if they were binned like the model bins them
+static bool checkHOGStorage(const NaiveBayesModel *model, const HOGFeatures *hogFeatures) {
+    if (hogFeatures->storage == HOG_STORAGE_BINNED && hogFeatures->quantBins != model->numBins) {
+        printf("Error: HOG features are binned into %d bins but the model uses %d\n",
+               hogFeatures->quantBins, model->numBins);
+        return false;
+    }
+    return true;
+}
+
+// Bytes rounded up so the next table stays aligned
+static size_t alignedTableBytes(size_t bytes) {
+    return (bytes + NB_TABLE_ALIGN - 1) / NB_TABLE_ALIGN * NB_TABLE_ALIGN;
+}
+
+// Number of classes rounded up to whole SIMD lanes
+static int classStrideFor(int numClasses) {
+    return (numClasses + NB_CLASS_LANES - 1) / NB_CLASS_LANES * NB_CLASS_LANES;
+}
+
+// Size of the table block for the given dimensions: the per-class arrays
+// classLogPrior, classLogDenom, classScoreBias and classCounts (each padded
+// to classStride), then featureLogCount, featureLogCountT and featureCounts
+static size_t modelTableBytes(int numClasses, uint32_t numFeatures, int numBins) {
+    size_t classStride = classStrideFor(numClasses);
+    size_t tableSize = (size_t)numClasses * numFeatures * numBins;
+    return 3 * alignedTableBytes(classStride * sizeof(double)) +
+           alignedTableBytes(classStride * sizeof(uint32_t)) +
+           alignedTableBytes(tableSize * sizeof(double)) +
+           alignedTableBytes((size_t)numFeatures * numBins * classStride * sizeof(double)) +
+           alignedTableBytes(tableSize * sizeof(uint32_t));
+}
+
+// Point the model's tables into a table block laid out by modelTableBytes
+static void bindModelTables(NaiveBayesModel *model, void *tables) {
+    size_t tableSize = (size_t)model->numClasses * model->numFeatures * model->numBins;
+    uint8_t *next = (uint8_t*)tables;
+    model->classLogPrior = (double*)next;
+    next += alignedTableBytes(model->classStride * sizeof(double));
+    model->classLogDenom = (double*)next;
+    next += alignedTableBytes(model->classStride * sizeof(double));
+    model->classScoreBias = (double*)next;
+    next += alignedTableBytes(model->classStride * sizeof(double));
+    model->classCounts = (uint32_t*)next;
+    next += alignedTableBytes(model->classStride * sizeof(uint32_t));
+    model->featureLogCount = (double*)next;
+    next += alignedTableBytes(tableSize * sizeof(double));
+    model->featureLogCountT = (double*)next;
+    next += alignedTableBytes((size_t)model->numFeatures * model->numBins * model->classStride * sizeof(double));
+    model->featureCounts = (uint32_t*)next;
+}
+
+// Log of a smoothed count. The floor keeps log(0) out of the table, so
+// prediction never has to call log()
+static double logSmoothedCount(const NaiveBayesModel *model, uint32_t count) {
+    double smoothed = count + model->alpha;
+    return log(smoothed < NB_MIN_COUNT ? NB_MIN_COUNT : smoothed);
+}
+
+// Recompute both table entries of one (class, feature, bin) count
+static void refreshFeatureCount(NaiveBayesModel *model, int c, uint32_t f, int b) {
+    double logCount = logSmoothedCount(model, featureCountRow(model, c, f)[b]);
+    featureLogCountRow(model, c, f)[b] = logCount;
+    featureLogCountColumn(model, f, b)[c] = logCount;
+}
+
+// Recompute the per-class terms from the class counts: O(numClasses)
+static void refreshClassTerms(NaiveBayesModel *model) {
+    for (int c = 0; c < model->numClasses; c++) {
+        model->classLogPrior[c] = log((double)model->classCounts[c] / model->numImages);
+        model->classLogDenom[c] = log(model->classCounts[c] + model->alpha * model->numBins);
+        model->classScoreBias[c] = model->classLogPrior[c] - model->numFeatures * model->classLogDenom[c];
+    }
+}
+
+// Fill the feature-major table from the class-major one
+static void buildTransposedTable(NaiveBayesModel *model) {
+    for (uint32_t f = 0; f < model->numFeatures; f++) {
+        for (int b = 0; b < model->numBins; b++) {
+            double *column = featureLogCountColumn(model, f, b);
+            for (int c = 0; c < model->numClasses; c++) {
+                column[c] = featureLogCountRow(model, c, f)[b];
+            }
+        }
+    }
+}
+
+static void setModelShape(NaiveBayesModel *model, int numClasses, int numFeatures, int numBins, double alpha) {
     model->numClasses = numClasses;
     model->numFeatures = numFeatures;
     model->numBins = numBins;
+    model->classStride = classStrideFor(numClasses);
     model->binWidth = 1.0 / numBins;
     model->alpha = alpha;
+}
 
-    model->classPrior = (double*)malloc(numClasses * sizeof(double));
-    if (model->classPrior == NULL) {
-        printf("Failed to allocate memory for class priors\n");
-        return false;
-    }
+bool initNaiveBayes(NaiveBayesModel *model, int numClasses, int numFeatures, int numBins, double alpha) {
+    setModelShape(model, numClasses, numFeatures, numBins, alpha);
 
-    // Allocate memory for feature probabilities
-    model->featureProb = (double***)malloc(numClasses * sizeof(double**));
-    if (model->featureProb == NULL) {
-        free(model->classPrior);
-        printf("Failed to allocate memory for feature probabilities\n");
+    // One aligned block for all tables instead of a pointer tree of small rows
+    model->storageSize = modelTableBytes(numClasses, numFeatures, numBins);
+    model->mapped = false;
+    if (posix_memalign(&model->storage, NB_TABLE_ALIGN, model->storageSize) != 0) {
+        model->storage = NULL;
+        printf("Failed to allocate memory for model tables\n");
         return false;
     }
-
-    for (int c = 0; c < numClasses; c++) {
-        model->featureProb[c] = (double**)malloc(numFeatures * sizeof(double*));
-        if (model->featureProb[c] == NULL) {
-            // Clean up previously allocated memory
-            for (int i = 0; i < c; i++) {
-                free(model->featureProb[i]);
-            }
-            free(model->featureProb);
-            free(model->classPrior);
-            printf("Failed to allocate memory for feature probabilities\n");
-            return false;
-        }
-
-        for (int f = 0; f < numFeatures; f++) {
-            model->featureProb[c][f] = (double*)malloc(numBins * sizeof(double));
-            if (model->featureProb[c][f] == NULL) {
-                // Clean up previously allocated memory
-                for (int j = 0; j < f; j++) {
-                    free(model->featureProb[c][j]);
-                }
-                for (int i = 0; i < c; i++) {
-                    for (int j = 0; j < numFeatures; j++) {
-                        free(model->featureProb[i][j]);
-                    }
-                    free(model->featureProb[i]);
-                }
-                free(model->featureProb);
-                free(model->classPrior);
-                printf("Failed to allocate memory for feature probabilities\n");
-                return false;
-            }
-            memset(model->featureProb[c][f], 0, numBins * sizeof(double));
-        }
-    }
-    
-    memset(model->classPrior, 0, numClasses * sizeof(double));
+    memset(model->storage, 0, model->storageSize);
+    bindModelTables(model, model->storage);
+    model->numImages = 0;
     
     printf("Initialized HOG Naive Bayes model with %d classes, %d features, %d bins\n", 
            numClasses, numFeatures, numBins);
     
     return true;
 }
-void trainNaiveBayes(NaiveBayesModel *model, HOGFeatures *hogFeatures) {
-    if (model->numFeatures != hogFeatures->numFeatures) {
-        printf("Error: Feature count mismatch\n");
-        return;
+
+// Number of entries in a flat [class][feature][bin] count table
+static size_t countTableSize(const NaiveBayesModel *model) {
+    return (size_t)model->numClasses * model->numFeatures * model->numBins;
+}
+
+// Count one image whose features are already binned into counts[c][f][b] and classCounts
+static void countImage(const NaiveBayesModel *model, uint8_t label, const uint8_t *bins,
+                       uint32_t *counts, uint32_t *classCounts) {
+    classCounts[label]++;
+
+    uint32_t *classRows = &counts[(size_t)label * model->numFeatures * model->numBins];
+    for (uint32_t f = 0; f < model->numFeatures; f++) {
+        classRows[(size_t)f * model->numBins + bins[f]]++;
     }
+}
 
-    int ***counts;
-    int *classCounts;
+// Build every log table from the counts stored in the model
+static void rebuildModelTables(NaiveBayesModel *model) {
+    // Calculate the log smoothed counts (Laplace smoothing) and the class terms
+    size_t tableSize = countTableSize(model);
+    for (size_t i = 0; i < tableSize; i++) {
+        model->featureLogCount[i] = logSmoothedCount(model, model->featureCounts[i]);
+    }
+    buildTransposedTable(model);
+    refreshClassTerms(model);
+}
 
-    // Allocate memory for counts
-    counts = (int***)malloc(model->numClasses * sizeof(int**));
-    for (int c = 0; c < model->numClasses; c++) {
-        counts[c] = (int**)malloc(model->numFeatures * sizeof(int*));
-        for (int f = 0; f < model->numFeatures; f++) {
-            counts[c][f] = (int*)malloc(model->numBins * sizeof(int));
-            memset(counts[c][f], 0, model->numBins * sizeof(int));
+// Store the counts of numImages training images in the model and build every table from them
+static void finalizeNaiveBayes(NaiveBayesModel *model, const uint32_t *counts,
+                               const uint32_t *classCounts, uint32_t numImages) {
+    memcpy(model->featureCounts, counts, countTableSize(model) * sizeof(uint32_t));
+    memcpy(model->classCounts, classCounts, model->numClasses * sizeof(uint32_t));
+    model->numImages = numImages;
+    rebuildModelTables(model);
+
+    printf("Trained HOG Naive Bayes model\n");
+}
+
+// Shared state for summing per-worker count shards into the first shard
+typedef struct {
+    uint32_t *shards;
+    size_t tableSize;
+    int workers;
+} ReduceContext;
+
+// Each worker owns a stripe [begin, end) of the table and adds the other
+// shards' entries for that stripe, so no entry is written by two threads
+static void reduceShardsWorker(uint32_t begin, uint32_t end, int worker, void *context) {
+    ReduceContext *reduce = (ReduceContext*)context;
+    (void)worker;
+
+    for (int w = 1; w < reduce->workers; w++) {
+        const uint32_t *shard = &reduce->shards[w * reduce->tableSize];
+        for (uint32_t i = begin; i < end; i++) {
+            reduce->shards[i] += shard[i];
+        }
+    }
+}
+
+// Sum `workers` count-table and class-count shards into the first of each
+static void reduceCountShards(const NaiveBayesModel *model, uint32_t *countShards,
+                              uint32_t *classCountShards, int workers) {
+    ReduceContext reduce = {countShards, countTableSize(model), workers};
+    parallelFor((uint32_t)reduce.tableSize, workers, reduceShardsWorker, &reduce);
+
+    for (int w = 1; w < workers; w++) {
+        for (int c = 0; c < model->numClasses; c++) {
+            classCountShards[c] += classCountShards[w * model->numClasses + c];
         }
     }
+}
+
+// Shared state for counting workers
+typedef struct {
+    const NaiveBayesModel *model;
+    const HOGFeatures *hogFeatures;
+    uint32_t *countShards;       // One count table per worker
+    uint32_t *classCountShards;  // One numClasses array per worker
+} CountContext;
 
-    classCounts = (int*)malloc(model->numClasses * sizeof(int));
-    memset(classCounts, 0, model->numClasses * sizeof(int));
+static void countWorker(uint32_t begin, uint32_t end, int worker, void *context) {
+    CountContext *count = (CountContext*)context;
+    const NaiveBayesModel *model = count->model;
+    uint32_t *counts = &count->countShards[(size_t)worker * countTableSize(model)];
+    uint32_t *classCounts = &count->classCountShards[(size_t)worker * model->numClasses];
 
     // Count feature occurrences
-    for (uint32_t i = 0; i < hogFeatures->numImages; i++) {
-        uint8_t label = hogFeatures->labels[i];
+    uint8_t bins[model->numFeatures];
+    for (uint32_t i = begin; i < end; i++) {
+        uint8_t label = count->hogFeatures->labels[i];
         if (label >= model->numClasses) {
             printf("Warning: Label %d out of range\n", label);
             continue;
         }
         
-        classCounts[label]++;
-        
-        double *features = &hogFeatures->features[i * hogFeatures->numFeatures];
-        for (int f = 0; f < model->numFeatures; f++) {
-            int bin = getHOGBin(features[f], model->binWidth);
-            counts[label][f][bin]++;
+        getHOGBins(count->hogFeatures, i, model->numBins, bins);
+        countImage(model, label, bins, counts, classCounts);
+    }
+}
+
+void trainNaiveBayes(NaiveBayesModel *model, HOGFeatures *hogFeatures) {
+    if (model->numFeatures != hogFeatures->numFeatures) {
+        printf("Error: Feature count mismatch\n");
+        return;
+    }
+    if (!checkHOGStorage(model, hogFeatures)) {
+        return;
+    }
+
+    // Each worker counts a slice of the images into its own flat shard
+    int workers = parallelWorkerCount(hogFeatures->numImages, 0);
+    size_t tableSize = countTableSize(model);
+    uint32_t *countShards = (uint32_t*)calloc(workers * tableSize, sizeof(uint32_t));
+    uint32_t *classCountShards = (uint32_t*)calloc((size_t)workers * model->numClasses, sizeof(uint32_t));
+    if (countShards == NULL || classCountShards == NULL) {
+        printf("Failed to allocate memory for training counts\n");
+        free(countShards);
+        free(classCountShards);
+        return;
+    }
+
+    CountContext count = {model, hogFeatures, countShards, classCountShards};
+    parallelFor(hogFeatures->numImages, workers, countWorker, &count);
+    reduceCountShards(model, countShards, classCountShards, workers);
+
+    finalizeNaiveBayes(model, countShards, classCountShards, hogFeatures->numImages);
+
+    // Free temporary memory
+    free(countShards);
+    free(classCountShards);
+}
+
+// Shared state for fused extract-and-count training workers
+typedef struct {
+    NaiveBayesTrainer *trainer;
+    const MNISTDataset *dataset;
+} FusedTrainContext;
+
+static void fusedTrainWorker(uint32_t begin, uint32_t end, int worker, void *context) {
+    FusedTrainContext *train = (FusedTrainContext*)context;
+    NaiveBayesTrainer *trainer = train->trainer;
+    const NaiveBayesModel *model = trainer->model;
+    const MNISTDataset *dataset = train->dataset;
+    uint32_t *counts = &trainer->countShards[(size_t)worker * countTableSize(model)];
+    uint32_t *classCounts = &trainer->classCountShards[(size_t)worker * model->numClasses];
+
+    // The only per-image state: one feature vector and its bins
+    double features[model->numFeatures];
+    uint8_t bins[model->numFeatures];
+
+    for (uint32_t i = begin; i < end; i++) {
+        uint8_t label = dataset->labels[i];
+        if (label >= model->numClasses) {
+            printf("Warning: Label %d out of range\n", label);
+            continue;
         }
+
+        computeHOGImage(&dataset->images[(size_t)i * dataset->imageSize], dataset->rows, dataset->cols,
+                        trainer->cellSize, trainer->hogBins, features);
+        for (uint32_t f = 0; f < model->numFeatures; f++) {
+            bins[f] = (uint8_t)hogValueBin(features[f], model->numBins);
+        }
+        countImage(model, label, bins, counts, classCounts);
     }
+}
 
-    // Calculate class priors
-    for (int c = 0; c < model->numClasses; c++) {
-        model->classPrior[c] = (double)classCounts[c] / hogFeatures->numImages;
+bool beginNaiveBayesTraining(NaiveBayesTrainer *trainer, NaiveBayesModel *model,
+                             int cellSize, int hogBins, int numThreads) {
+    trainer->model = model;
+    trainer->cellSize = cellSize;
+    trainer->hogBins = hogBins;
+    trainer->numImages = 0;
+    trainer->failed = false;
+
+    // Each worker counts into its own shard; the shards are summed at the end
+    trainer->workers = numThreads > 0 ? numThreads : getDefaultThreadCount();
+    size_t tableSize = countTableSize(model);
+    trainer->countShards = (uint32_t*)calloc(trainer->workers * tableSize, sizeof(uint32_t));
+    trainer->classCountShards = (uint32_t*)calloc((size_t)trainer->workers * model->numClasses, sizeof(uint32_t));
+    if (trainer->countShards == NULL || trainer->classCountShards == NULL) {
+        printf("Failed to allocate memory for training counts\n");
+        free(trainer->countShards);
+        free(trainer->classCountShards);
+        trainer->countShards = NULL;
+        trainer->classCountShards = NULL;
+        return false;
+    }
+
+    prepareHOGExtraction(hogBins);
+    return true;
+}
+
+bool addNaiveBayesTrainingImages(NaiveBayesTrainer *trainer, const MNISTDataset *images) {
+    const NaiveBayesModel *model = trainer->model;
+    uint32_t numFeatures = (images->rows / trainer->cellSize) * (images->cols / trainer->cellSize) *
+                           trainer->hogBins;
+    if (model->numFeatures != numFeatures) {
+        printf("Error: Feature count mismatch\n");
+        trainer->failed = true;
+        return false;
+    }
+    if (images->labels == NULL) {
+        printf("Error: Training data has no labels\n");
+        trainer->failed = true;
+        return false;
+    }
+
+    FusedTrainContext train = {trainer, images};
+    parallelFor(images->numImages, trainer->workers, fusedTrainWorker, &train);
+    trainer->numImages += images->numImages;
+    return true;
+}
+
+bool finishNaiveBayesTraining(NaiveBayesTrainer *trainer) {
+    NaiveBayesModel *model = trainer->model;
+    bool ok = !trainer->failed && trainer->numImages > 0;
+
+    if (ok) {
+        reduceCountShards(model, trainer->countShards, trainer->classCountShards, trainer->workers);
+        finalizeNaiveBayes(model, trainer->countShards, trainer->classCountShards, trainer->numImages);
+    } else if (!trainer->failed) {
+        printf("Error: No training images\n");
+    }
+
+    free(trainer->countShards);
+    free(trainer->classCountShards);
+    trainer->countShards = NULL;
+    trainer->classCountShards = NULL;
+    return ok;
+}
+
+bool trainNaiveBayesFromDataset(NaiveBayesModel *model, const MNISTDataset *dataset,
+                                int cellSize, int hogBins, int numThreads) {
+    NaiveBayesTrainer trainer;
+    if (!beginNaiveBayesTraining(&trainer, model, cellSize, hogBins,
+                                 parallelWorkerCount(dataset->numImages, numThreads))) {
+        return false;
     }
+    addNaiveBayesTrainingImages(&trainer, dataset);
+    return finishNaiveBayesTraining(&trainer);
+}
 
-    // Calculate feature probabilities with Laplace smoothing
+// Score every class for one image whose features are already binned. Writes
+// the per-class log probabilities to logProbs (if not NULL) and returns the
+// best class.
+//
+// Walks the feature-major table: each feature's contiguous row of class
+// log-probs is added to all class scores. Every class still sums prior +
+// features in feature order, so the scores match a class-by-class
+// evaluation exactly.
+NB_TARGET_CLONES
+uint8_t scoreNaiveBayesBins(const NaiveBayesModel *model, const uint8_t *bins, double *logProbs) {
+    int classStride = model->classStride;
+    double scores[classStride];
+    memcpy(scores, model->classScoreBias, classStride * sizeof(double));
+    
+    for (uint32_t f = 0; f < model->numFeatures; f++) {
+        // Add this feature's log count (already floored at training time) to every class
+        const double *column = featureLogCountColumn(model, f, bins[f]);
+        for (int c = 0; c < classStride; c += NB_CLASS_LANES) {
+            for (int k = 0; k < NB_CLASS_LANES; k++) {
+                scores[c + k] += column[c + k];
+            }
+        }
+    }
+    
+    double maxLogProb = -INFINITY;
+    int bestClass = 0;
     for (int c = 0; c < model->numClasses; c++) {
-        for (int f = 0; f < model->numFeatures; f++) {
-            for (int b = 0; b < model->numBins; b++) {
-                model->featureProb[c][f][b] = 
-                    (counts[c][f][b] + model->alpha) / 
-                    (classCounts[c] + model->alpha * model->numBins);
+        if (logProbs != NULL) {
+            logProbs[c] = scores[c];
+        }
+        
+        if (scores[c] > maxLogProb) {
+            maxLogProb = scores[c];
+            bestClass = c;
+        }
+    }
+    
+    return (uint8_t)bestClass;
+}
+
+uint8_t scoreNaiveBayes(const NaiveBayesModel *model, const double *features, double *logProbs) {
+    // Determine which bin each feature value falls into
+    uint8_t bins[model->numFeatures];
+    for (uint32_t f = 0; f < model->numFeatures; f++) {
+        bins[f] = (uint8_t)hogValueBin(features[f], model->numBins);
+    }
+    return scoreNaiveBayesBins(model, bins, logProbs);
+}
+
+// Only features whose bin changed contribute, each with the difference of
+// its two log counts; the class bias and denominators don't change
+NB_TARGET_CLONES
+uint8_t rescoreNaiveBayesBins(const NaiveBayesModel *model, const uint8_t *oldBins,
+                              const uint8_t *newBins, double *logProbs) {
+    int classStride = model->classStride;
+    double scores[classStride];
+    memcpy(scores, logProbs, model->numClasses * sizeof(double));
+    memset(&scores[model->numClasses], 0, (classStride - model->numClasses) * sizeof(double));
+
+    for (uint32_t f = 0; f < model->numFeatures; f++) {
+        if (oldBins[f] == newBins[f]) {
+            continue;
+        }
+        const double *added = featureLogCountColumn(model, f, newBins[f]);
+        const double *removed = featureLogCountColumn(model, f, oldBins[f]);
+        for (int c = 0; c < classStride; c += NB_CLASS_LANES) {
+            for (int k = 0; k < NB_CLASS_LANES; k++) {
+                scores[c + k] += added[c + k] - removed[c + k];
             }
         }
     }
 
-    // Free temporary memory
+    double maxLogProb = -INFINITY;
+    int bestClass = 0;
     for (int c = 0; c < model->numClasses; c++) {
-        for (int f = 0; f < model->numFeatures; f++) {
-            free(counts[c][f]);
+        logProbs[c] = scores[c];
+        if (scores[c] > maxLogProb) {
+            maxLogProb = scores[c];
+            bestClass = c;
         }
-        free(counts[c]);
     }
-    free(counts);
-    free(classCounts);
+    return (uint8_t)bestClass;
+}
 
-    printf("Trained HOG Naive Bayes model\n");
+bool updateNaiveBayes(NaiveBayesModel *model, const double *features, const uint8_t *labels, uint32_t n) {
+    if (model->mapped) {
+        printf("Error: A mapped model is read-only and can't be updated\n");
+        return false;
+    }
+
+    uint8_t bins[model->numFeatures];
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t label = labels[i];
+        if (label >= model->numClasses) {
+            printf("Warning: Label %d out of range\n", label);
+            continue;
+        }
+
+        const double *imageFeatures = &features[(size_t)i * model->numFeatures];
+        for (uint32_t f = 0; f < model->numFeatures; f++) {
+            bins[f] = (uint8_t)hogValueBin(imageFeatures[f], model->numBins);
+        }
+        countImage(model, label, bins, model->featureCounts, model->classCounts);
+
+        // Only the entries whose counts just changed
+        for (uint32_t f = 0; f < model->numFeatures; f++) {
+            refreshFeatureCount(model, label, f, bins[f]);
+        }
+    }
+
+    // Every prior depends on the total, so all classes' terms are refreshed
+    model->numImages += n;
+    refreshClassTerms(model);
+    return true;
+}
+
+bool mergeNaiveBayes(NaiveBayesModel *model, const NaiveBayesModel *other) {
+    if (model->mapped) {
+        printf("Error: A mapped model is read-only and can't be merged into\n");
+        return false;
+    }
+    if (model->numClasses != other->numClasses || model->numFeatures != other->numFeatures ||
+        model->numBins != other->numBins || model->alpha != other->alpha) {
+        printf("Error: Can't merge a %d-class, %u-feature, %d-bin model (alpha %g) into a "
+               "%d-class, %u-feature, %d-bin model (alpha %g)\n",
+               other->numClasses, other->numFeatures, other->numBins, other->alpha,
+               model->numClasses, model->numFeatures, model->numBins, model->alpha);
+        return false;
+    }
+
+    // Counts add exactly, so the merged tables match training on the union
+    size_t tableSize = countTableSize(model);
+    for (size_t i = 0; i < tableSize; i++) {
+        model->featureCounts[i] += other->featureCounts[i];
+    }
+    for (int c = 0; c < model->numClasses; c++) {
+        model->classCounts[c] += other->classCounts[c];
+    }
+    model->numImages += other->numImages;
+
+    rebuildModelTables(model);
+    return true;
 }
 
-// Function to predict the digit for a single image
 // Function to predict the digit for a single image
 uint8_t predictNaiveBayes(NaiveBayesModel *model, double *features) {
-    double maxLogProb = -INFINITY;
+    return scoreNaiveBayes(model, features, NULL);
+}
+
+bool quantizeNaiveBayes(NaiveBayesQuantized *quantized, const NaiveBayesModel *model) {
+    uint32_t numFeatures = model->numFeatures;
+    int numClasses = model->numClasses;
+    int numBins = model->numBins;
+    int classStride = (numClasses + NB_QUANT_LANES - 1) / NB_QUANT_LANES * NB_QUANT_LANES;
+    size_t columnsSize = (size_t)numFeatures * numBins * classStride;
+
+    quantized->numClasses = numClasses;
+    quantized->numFeatures = numFeatures;
+    quantized->numBins = numBins;
+    quantized->classStride = classStride;
+
+    // Bias first, so the table behind it stays aligned
+    quantized->storageSize = alignedTableBytes(classStride * sizeof(int32_t)) + columnsSize * sizeof(int16_t);
+    if (posix_memalign(&quantized->storage, NB_TABLE_ALIGN, quantized->storageSize) != 0) {
+        quantized->storage = NULL;
+        printf("Failed to allocate memory for quantized model tables\n");
+        return false;
+    }
+    memset(quantized->storage, 0, quantized->storageSize);
+    quantized->classScoreBias = (int32_t*)quantized->storage;
+    quantized->featureLogCountT = (int16_t*)((uint8_t*)quantized->storage +
+                                             alignedTableBytes(classStride * sizeof(int32_t)));
+
+    // One scale for the whole model: the largest log count maps to INT16_MAX,
+    // unless a full sum could then overflow the int32 accumulator. Classes
+    // never seen in training have a bias of -inf and are left out of that.
+    double maxLogCount = 0.0, maxBias = 0.0;
+    size_t tableSize = countTableSize(model);
+    for (size_t i = 0; i < tableSize; i++) {
+        maxLogCount = fabs(model->featureLogCount[i]) > maxLogCount ? fabs(model->featureLogCount[i]) : maxLogCount;
+    }
+    for (int c = 0; c < numClasses; c++) {
+        if (isfinite(model->classScoreBias[c])) {
+            maxBias = fabs(model->classScoreBias[c]) > maxBias ? fabs(model->classScoreBias[c]) : maxBias;
+        }
+    }
+    double scale = maxLogCount > 0.0 ? INT16_MAX / maxLogCount : 1.0;
+    double sumLimit = (INT32_MAX / 2) / (maxBias + numFeatures * maxLogCount + 1.0);
+    quantized->scale = scale < sumLimit ? scale : sumLimit;
+
+    for (int c = 0; c < numClasses; c++) {
+        double bias = model->classScoreBias[c];
+        quantized->classScoreBias[c] = isfinite(bias) ? (int32_t)lrint(bias * quantized->scale) : INT32_MIN / 2;
+    }
+    for (uint32_t f = 0; f < numFeatures; f++) {
+        for (int b = 0; b < numBins; b++) {
+            int16_t *column = quantizedLogCountColumn(quantized, f, b);
+            for (int c = 0; c < numClasses; c++) {
+                column[c] = (int16_t)lrint(featureLogCountRow(model, c, f)[b] * quantized->scale);
+            }
+        }
+    }
+
+    return true;
+}
+
+// Add the quantized log counts of the binned features to scores[classStride]
+static void accumulateQuantizedScalar(const NaiveBayesQuantized *quantized, const uint8_t *bins, int32_t *scores) {
+    for (uint32_t f = 0; f < quantized->numFeatures; f++) {
+        const int16_t *column = quantizedLogCountColumn(quantized, f, bins[f]);
+        for (int c = 0; c < quantized->classStride; c++) {
+            scores[c] += column[c];
+        }
+    }
+}
+
+#ifdef NB_X86_SIMD
+// Same as accumulateQuantizedScalar, 16 classes at a time: each feature's
+// 16 int16 terms are widened to int32 and added to two accumulator registers
+__attribute__((target("avx2")))
+static void accumulateQuantizedAVX2(const NaiveBayesQuantized *quantized, const uint8_t *bins, int32_t *scores) {
+    for (int c = 0; c < quantized->classStride; c += NB_QUANT_LANES) {
+        __m256i low = _mm256_loadu_si256((const __m256i*)&scores[c]);
+        __m256i high = _mm256_loadu_si256((const __m256i*)&scores[c + 8]);
+        for (uint32_t f = 0; f < quantized->numFeatures; f++) {
+            __m256i terms = _mm256_load_si256((const __m256i*)&quantizedLogCountColumn(quantized, f, bins[f])[c]);
+            low = _mm256_add_epi32(low, _mm256_cvtepi16_epi32(_mm256_castsi256_si128(terms)));
+            high = _mm256_add_epi32(high, _mm256_cvtepi16_epi32(_mm256_extracti128_si256(terms, 1)));
+        }
+        _mm256_storeu_si256((__m256i*)&scores[c], low);
+        _mm256_storeu_si256((__m256i*)&scores[c + 8], high);
+    }
+}
+#endif
+
+uint8_t scoreNaiveBayesQuantized(const NaiveBayesQuantized *quantized, const uint8_t *bins, int32_t *scores) {
+    int32_t classScores[quantized->classStride];
+    memcpy(classScores, quantized->classScoreBias, quantized->classStride * sizeof(int32_t));
+
+#ifdef NB_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        accumulateQuantizedAVX2(quantized, bins, classScores);
+    } else
+#endif
+    {
+        accumulateQuantizedScalar(quantized, bins, classScores);
+    }
+
     int bestClass = 0;
-    
-    // Calculate log probability for each class
-    for (int c = 0; c < model->numClasses; c++) {
-        double logProb = log(model->classPrior[c]);
-        
-        for (int f = 0; f < model->numFeatures; f++) {
-            // Ensure feature value is in valid range
-            double featureVal = features[f];
-            featureVal = (featureVal < 0) ? 0 : (featureVal > 1.0 ? 1.0 : featureVal);
-            
-            // Determine which bin the orientation falls into
-            int bin = (int)(featureVal / model->binWidth);
-            
-            // Safety check for valid bin index
-            bin = (bin < 0) ? 0 : (bin >= model->numBins ? model->numBins - 1 : bin);
-            
-            // Add log probability from this feature
-            double prob = model->featureProb[c][f][bin];
-            
-            // Ensure probability is not zero (avoid log(0))
-            prob = (prob < 1e-10) ? 1e-10 : prob;
-            
-            logProb += log(prob);
+    for (int c = 0; c < quantized->numClasses; c++) {
+        if (scores != NULL) {
+            scores[c] = classScores[c];
         }
-        
-        if (logProb > maxLogProb) {
-            maxLogProb = logProb;
+        if (classScores[c] > classScores[bestClass]) {
             bestClass = c;
         }
     }
-    
     return (uint8_t)bestClass;
 }
 
-void freeNaiveBayes(NaiveBayesModel *model) {
-    for (int c = 0; c < model->numClasses; c++) {
-        for (int f = 0; f < model->numFeatures; f++) {
-            free(model->featureProb[c][f]);
+void freeNaiveBayesQuantized(NaiveBayesQuantized *quantized) {
+    free(quantized->storage);
+    quantized->storage = NULL;
+    quantized->classScoreBias = NULL;
+    quantized->featureLogCountT = NULL;
+}
+
+// Shared state for batch prediction workers
+typedef struct {
+    const NaiveBayesModel *model;
+    const HOGFeatures *hogFeatures;
+    const uint8_t *labels;
+    uint8_t *out;
+    int *confusionShards;     // One numClasses x numClasses matrix per worker
+    uint32_t *correctShards;  // One correct count per worker
+} BatchContext;
+
+static void predictBatchWorker(uint32_t begin, uint32_t end, int worker, void *context) {
+    BatchContext *batch = (BatchContext*)context;
+    const NaiveBayesModel *model = batch->model;
+    int numClasses = model->numClasses;
+    int *confusion = batch->confusionShards != NULL ?
+        &batch->confusionShards[(size_t)worker * numClasses * numClasses] : NULL;
+    uint32_t correct = 0;
+    uint8_t bins[model->numFeatures];
+
+    for (uint32_t i = begin; i < end; i++) {
+        const uint8_t *imageBins = bins;
+        if (batch->hogFeatures->storage == HOG_STORAGE_BINNED) {
+            imageBins = &batch->hogFeatures->bins[(size_t)i * model->numFeatures];
+        } else {
+            getHOGBins(batch->hogFeatures, i, model->numBins, bins);
+        }
+        uint8_t prediction = scoreNaiveBayesBins(model, imageBins, NULL);
+        if (batch->out != NULL) {
+            batch->out[i] = prediction;
+        }
+
+        if (batch->labels != NULL) {
+            uint8_t actual = batch->labels[i];
+            if (confusion != NULL && actual < numClasses) {
+                confusion[actual * numClasses + prediction]++;
+            }
+            if (prediction == actual) {
+                correct++;
+            }
+        }
+    }
+
+    if (batch->correctShards != NULL) {
+        batch->correctShards[worker] = correct;
+    }
+}
+
+void predictNaiveBayesBatch(const NaiveBayesModel *model, const HOGFeatures *hogFeatures, uint8_t *out) {
+    if (hogFeatures->numFeatures != model->numFeatures || !checkHOGStorage(model, hogFeatures)) {
+        return;
+    }
+    BatchContext batch = {model, hogFeatures, NULL, out, NULL, NULL};
+    parallelFor(hogFeatures->numImages, 0, predictBatchWorker, &batch);
+}
+
+uint32_t evaluateNaiveBayesBatch(const NaiveBayesModel *model, const HOGFeatures *hogFeatures, int *confusion) {
+    if (hogFeatures->numFeatures != model->numFeatures || !checkHOGStorage(model, hogFeatures)) {
+        return 0;
+    }
+    uint32_t n = hogFeatures->numImages;
+    int numClasses = model->numClasses;
+    int workers = parallelWorkerCount(n, 0);
+    size_t matrixSize = (size_t)numClasses * numClasses;
+
+    // Each worker counts into its own shard so no counter is shared between threads
+    int *confusionShards = (int*)calloc(workers * matrixSize, sizeof(int));
+    uint32_t *correctShards = (uint32_t*)calloc(workers, sizeof(uint32_t));
+    if (confusionShards == NULL || correctShards == NULL) {
+        printf("Failed to allocate memory for evaluation shards\n");
+        free(confusionShards);
+        free(correctShards);
+        return 0;
+    }
+
+    BatchContext batch = {model, hogFeatures, hogFeatures->labels, NULL, confusionShards, correctShards};
+    parallelFor(n, workers, predictBatchWorker, &batch);
+
+    // Merge the shards
+    uint32_t correct = 0;
+    for (int w = 0; w < workers; w++) {
+        correct += correctShards[w];
+        if (confusion != NULL) {
+            for (size_t i = 0; i < matrixSize; i++) {
+                confusion[i] += confusionShards[w * matrixSize + i];
+            }
         }
-        free(model->featureProb[c]);
     }
-    free(model->featureProb);
-    free(model->classPrior);
+
+    free(confusionShards);
+    free(correctShards);
+    return correct;
+}
+
+_Static_assert(sizeof(NaiveBayesFileHeader) == NB_TABLE_ALIGN,
+               "model tables must start aligned in a mapped file");
+
+// Check a model file header against the caller's HOG parameters and the file size
+static bool checkModelHeader(const NaiveBayesFileHeader *header, const char *filename,
+                             int cellSize, int hogBins, size_t payloadBytes) {
+    if (header->magic != NB_MODEL_MAGIC) {
+        printf("Error: %s is not a Naive Bayes model file\n", filename);
+        return false;
+    }
+
+    if (header->version != NB_MODEL_VERSION) {
+        printf("Error: %s has model format version %u, expected %u\n",
+               filename, header->version, NB_MODEL_VERSION);
+        return false;
+    }
+
+    // A model trained on different HOG cells or orientation bins would silently
+    // mis-score every feature, so refuse to load it
+    if (header->cellSize != cellSize || header->hogBins != hogBins) {
+        printf("ERROR: HOG parameter mismatch! Model %s was trained with cellSize=%d, numBins=%d "
+               "but the caller uses cellSize=%d, numBins=%d\n",
+               filename, header->cellSize, header->hogBins, cellSize, hogBins);
+        return false;
+    }
+
+    if (header->numClasses <= 0 || header->numFeatures == 0 || header->numBins <= 0 ||
+        header->tableBytes != modelTableBytes(header->numClasses, header->numFeatures, header->numBins)) {
+        printf("Error: %s has an invalid model header\n", filename);
+        return false;
+    }
+
+    if (payloadBytes != header->tableBytes) {
+        printf("Error: %s is truncated\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool saveNaiveBayes(NaiveBayesModel *model, const char *filename, int cellSize, int hogBins) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        perror("Error opening model file for writing");
+        return false;
+    }
+
+    NaiveBayesFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = NB_MODEL_MAGIC;
+    header.version = NB_MODEL_VERSION;
+    header.numClasses = model->numClasses;
+    header.numFeatures = model->numFeatures;
+    header.numBins = model->numBins;
+    header.cellSize = cellSize;
+    header.hogBins = hogBins;
+    header.alpha = model->alpha;
+    header.tableBytes = model->storageSize;
+    header.numImages = model->numImages;
+
+    // The table block is written exactly as it sits in memory
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(model->storage, 1, model->storageSize, file) == model->storageSize;
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        printf("Failed to write model to %s\n", filename);
+        return false;
+    }
+
+    printf("Saved Naive Bayes model to %s\n", filename);
+    return true;
+}
+
+bool loadNaiveBayes(NaiveBayesModel *model, const char *filename, int cellSize, int hogBins) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        perror("Error opening model file");
+        return false;
+    }
+
+    struct stat st;
+    NaiveBayesFileHeader header;
+    if (fstat(fileno(file), &st) != 0 || fread(&header, sizeof(header), 1, file) != 1) {
+        printf("Error: %s is not a Naive Bayes model file\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    if (!checkModelHeader(&header, filename, cellSize, hogBins, (size_t)st.st_size - sizeof(header))) {
+        fclose(file);
+        return false;
+    }
+
+    if (!initNaiveBayes(model, header.numClasses, header.numFeatures, header.numBins, header.alpha)) {
+        fclose(file);
+        return false;
+    }
+
+    bool ok = fread(model->storage, 1, model->storageSize, file) == model->storageSize;
+    fclose(file);
+    model->numImages = header.numImages;
+
+    if (!ok) {
+        printf("Error: %s is truncated\n", filename);
+        freeNaiveBayes(model);
+        return false;
+    }
+
+    printf("Loaded Naive Bayes model from %s\n", filename);
+    return true;
+}
+
+bool mapNaiveBayes(NaiveBayesModel *model, const char *filename, int cellSize, int hogBins) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening model file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(NaiveBayesFileHeader)) {
+        printf("Error: %s is not a Naive Bayes model file\n", filename);
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Error mapping model file");
+        return false;
+    }
+
+    const NaiveBayesFileHeader *header = (const NaiveBayesFileHeader*)mapping;
+    if (!checkModelHeader(header, filename, cellSize, hogBins, (size_t)st.st_size - sizeof(*header))) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
+
+    setModelShape(model, header->numClasses, header->numFeatures, header->numBins, header->alpha);
+    model->numImages = header->numImages;
+    model->storage = mapping;
+    model->storageSize = st.st_size;
+    model->mapped = true;
+    bindModelTables(model, (uint8_t*)mapping + sizeof(*header));
+
+    printf("Mapped Naive Bayes model from %s (%d classes, %u features, %d bins)\n",
+           filename, model->numClasses, model->numFeatures, model->numBins);
+    return true;
+}
+
+void freeNaiveBayes(NaiveBayesModel *model) {
+    if (model->mapped) {
+        munmap(model->storage, model->storageSize);
+    } else {
+        free(model->storage);
+    }
+    model->storage = NULL;
+    model->featureCounts = NULL;
+    model->classCounts = NULL;
+    model->featureLogCount = NULL;
+    model->featureLogCountT = NULL;
+    model->classLogPrior = NULL;
+    model->classLogDenom = NULL;
+    model->classScoreBias = NULL;
 }
\ No newline at end of file
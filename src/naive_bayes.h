@@ -5,27 +5,210 @@
 #include <stdint.h>
 #include "mnist_loader.h"
 #include <stdbool.h>
+
+// On-disk model format: a 64-byte NaiveBayesFileHeader followed by the model's
+// table block exactly as it is laid out in memory (see initNaiveBayes), so a
+// model file can be mmap'ed and used in place. Doubles are in host byte order.
+#define NB_MODEL_MAGIC 0x4D42414Eu  // "NABM"
+#define NB_MODEL_VERSION 5
+
+// Alignment of the header and of every table inside the table block
+#define NB_TABLE_ALIGN 64
+
+// Class rows of the feature-major table are padded to a multiple of this
+// many doubles (one AVX-512 register)
+#define NB_CLASS_LANES 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t numClasses;
+    uint32_t numFeatures;
+    int32_t numBins;      // Model bins per feature
+    int32_t cellSize;     // HOG cell size the model was trained with
+    int32_t hogBins;      // HOG orientation bins the model was trained with
+    int32_t reserved;
+    double alpha;
+    uint64_t tableBytes;  // Size of the table block that follows the header
+    uint64_t numImages;   // Training images counted so far
+    uint8_t padding[8];
+} NaiveBayesFileHeader;
+
 typedef struct {
     
     int numClasses;
     uint32_t numFeatures;
     int numBins;
+    int classStride;      // numClasses rounded up to NB_CLASS_LANES
     double binWidth;
     double alpha;
 
-    double ***featureProb;
+    // The model keeps its raw training counts, so new samples can be added
+    // without retraining (see updateNaiveBayes)
+    uint32_t *featureCounts;  // [numClasses][numFeatures][numBins]
+    uint32_t *classCounts;    // Padded with zeros to classStride
+    uint64_t numImages;       // Training images counted, including any with bad labels
+
+    // log P(bin | class) = featureLogCount - classLogDenom: the smoothed count's
+    // log only changes when that count changes, and the per-class denominator
+    // is folded into classScoreBias once per class rather than once per feature.
+
+    // Log smoothed counts log(count + alpha), [numClasses][numFeatures][numBins]
+    // in one contiguous, aligned block
+    double *featureLogCount;
+
+    // The same log counts feature-major, [numFeatures][numBins][classStride],
+    // so scoring reads one contiguous row of classes per feature
+    double *featureLogCountT;
 
-    double *classPrior;
+    double *classLogPrior;   // log(classCount / numImages)
+    double *classLogDenom;   // log(classCount + alpha * numBins)
+    double *classScoreBias;  // classLogPrior - numFeatures * classLogDenom, where scoring starts
+
+    // (the per-class arrays above are padded with zeros to classStride)
+
+    // Single allocation (or file mapping) holding all of the tables above
+    void *storage;
+    size_t storageSize;
+    bool mapped;          // storage is a read-only mmap of a model file
 } NaiveBayesModel;
 
+// Smallest smoothed count stored in the tables, so log(0) never happens even with alpha = 0
+#define NB_MIN_COUNT 1e-10
+
+// Log smoothed counts of every bin of feature f for class c
+static inline double *featureLogCountRow(const NaiveBayesModel *model, int c, uint32_t f) {
+    return &model->featureLogCount[((size_t)c * model->numFeatures + f) * model->numBins];
+}
+
+// Log smoothed counts of every class for bin b of feature f
+static inline double *featureLogCountColumn(const NaiveBayesModel *model, uint32_t f, int b) {
+    return &model->featureLogCountT[((size_t)f * model->numBins + b) * model->classStride];
+}
+
+// Raw training counts of every bin of feature f for class c
+static inline uint32_t *featureCountRow(const NaiveBayesModel *model, int c, uint32_t f) {
+    return &model->featureCounts[((size_t)c * model->numFeatures + f) * model->numBins];
+}
+
+// log P(bin b of feature f | class c)
+static inline double featureLogProbability(const NaiveBayesModel *model, int c, uint32_t f, int b) {
+    return featureLogCountRow(model, c, f)[b] - model->classLogDenom[c];
+}
+
 // Function to initialize the Naive Bayes model
 bool initNaiveBayes(NaiveBayesModel *model, int numClasses, int numFeatures, int numBins, double alpha);
 
 // Function to train the Naive Bayes model
 void trainNaiveBayes(NaiveBayesModel *model, HOGFeatures *hogFeatures);
 
+// Train straight from the images: each worker computes one image's HOG
+// features and counts them right away, so the feature matrix is never built.
+// Gives the same model as extracting and calling trainNaiveBayes.
+bool trainNaiveBayesFromDataset(NaiveBayesModel *model, const MNISTDataset *dataset,
+                                int cellSize, int hogBins, int numThreads);
+
+// Fused training fed in batches, e.g. from an IDXStream:
+// begin, add every batch, then finish to build the model tables.
+typedef struct {
+    NaiveBayesModel *model;
+    int cellSize;
+    int hogBins;
+    int workers;
+    uint32_t *countShards;       // One [class][feature][bin] count table per worker
+    uint32_t *classCountShards;  // One numClasses array per worker
+    uint32_t numImages;          // Images added so far
+    bool failed;
+} NaiveBayesTrainer;
+
+bool beginNaiveBayesTraining(NaiveBayesTrainer *trainer, NaiveBayesModel *model,
+                             int cellSize, int hogBins, int numThreads);
+bool addNaiveBayesTrainingImages(NaiveBayesTrainer *trainer, const MNISTDataset *images);
+bool finishNaiveBayesTraining(NaiveBayesTrainer *trainer);
+
+// Add n newly labelled samples (n consecutive feature vectors) to a trained
+// model. Only the table entries whose counts change and the per-class terms
+// are recomputed, so the cost is O(n * numFeatures + numClasses).
+// Mapped models are read-only and can't be updated.
+bool updateNaiveBayes(NaiveBayesModel *model, const double *features, const uint8_t *labels, uint32_t n);
+
+// Add the counts of a model trained on other data (same shape and alpha) to
+// model and rebuild its tables. Merging models trained on disjoint shards
+// gives exactly the model trained on all of them at once.
+bool mergeNaiveBayes(NaiveBayesModel *model, const NaiveBayesModel *other);
+
 uint8_t predictNaiveBayes(NaiveBayesModel *model, double *features);
 
+// Scoring kernel shared by predictNaiveBayes and the interactive recognizer:
+// fills logProbs[numClasses] (if not NULL) and returns the best class
+uint8_t scoreNaiveBayes(const NaiveBayesModel *model, const double *features, double *logProbs);
+
+// Same as scoreNaiveBayes for features already binned with hogValueBin(value, model->numBins)
+uint8_t scoreNaiveBayesBins(const NaiveBayesModel *model, const uint8_t *bins, double *logProbs);
+
+// Int16 classes per AVX2 register; quantized class rows are padded to a multiple of this
+#define NB_QUANT_LANES 16
+
+// Fixed-point copy of a model's scoring tables: every log count and class
+// bias is multiplied by one per-model scale and rounded, log counts to
+// int16 and biases to int32. Scores are summed in int32, so the feature
+// table is a quarter of the size of featureLogCountT. It is a snapshot:
+// later training or merging doesn't reach it, so quantize again after
+// updating the model.
+typedef struct {
+    int numClasses;
+    uint32_t numFeatures;
+    int numBins;
+    int classStride;           // numClasses rounded up to NB_QUANT_LANES
+    double scale;              // Fixed-point units per nat
+    int32_t *classScoreBias;   // round(classScoreBias * scale), padded to classStride
+    int16_t *featureLogCountT; // round(featureLogCount * scale), [numFeatures][numBins][classStride]
+    void *storage;             // Single allocation holding both tables
+    size_t storageSize;
+} NaiveBayesQuantized;
+
+// Quantized log counts of every class for bin b of feature f
+static inline int16_t *quantizedLogCountColumn(const NaiveBayesQuantized *quantized, uint32_t f, int b) {
+    return &quantized->featureLogCountT[((size_t)f * quantized->numBins + b) * quantized->classStride];
+}
+
+bool quantizeNaiveBayes(NaiveBayesQuantized *quantized, const NaiveBayesModel *model);
+
+// Same as scoreNaiveBayesBins on the quantized tables: fills scores[numClasses]
+// (if not NULL) with the fixed-point log probabilities and returns the best
+// class. Uses AVX2 when the CPU has it.
+uint8_t scoreNaiveBayesQuantized(const NaiveBayesQuantized *quantized, const uint8_t *bins, int32_t *scores);
+
+void freeNaiveBayesQuantized(NaiveBayesQuantized *quantized);
+
+// Move logProbs[numClasses] from the scores of oldBins (as filled by
+// scoreNaiveBayesBins) to those of newBins, touching only the features
+// whose bin changed: O(changed features * numClasses). Equal to scoring
+// newBins afresh up to rounding, which builds up over many updates, so
+// rescore from scratch now and then. Returns the best class.
+uint8_t rescoreNaiveBayesBins(const NaiveBayesModel *model, const uint8_t *oldBins,
+                              const uint8_t *newBins, double *logProbs);
+
+// Function to predict every image of hogFeatures at once, spread over the
+// default number of threads; out receives numImages classes
+void predictNaiveBayesBatch(const NaiveBayesModel *model, const HOGFeatures *hogFeatures, uint8_t *out);
+
+// Function to predict the labelled images of hogFeatures in parallel. Adds the
+// results to confusion[actual * numClasses + predicted] (if not NULL) and
+// returns the number of correct predictions.
+uint32_t evaluateNaiveBayesBatch(const NaiveBayesModel *model, const HOGFeatures *hogFeatures, int *confusion);
+
+// Function to save a trained model together with the HOG parameters it was trained with
+bool saveNaiveBayes(NaiveBayesModel *model, const char *filename, int cellSize, int hogBins);
+
+// Function to load a saved model; fails if the file was written with different HOG parameters
+bool loadNaiveBayes(NaiveBayesModel *model, const char *filename, int cellSize, int hogBins);
+
+// Like loadNaiveBayes, but maps the file read-only and points the model straight
+// into it. The pages are shared with every other process mapping the same file.
+// A mapped model must not be trained; freeNaiveBayes unmaps it.
+bool mapNaiveBayes(NaiveBayesModel *model, const char *filename, int cellSize, int hogBins);
+
 void freeNaiveBayes(NaiveBayesModel *model);
 
 
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+static int gDefaultThreads = 0;
+
+// Arguments for one worker thread
+typedef struct {
+    ParallelWorkFn fn;
+    void *context;
+    uint32_t begin;
+    uint32_t end;
+    int worker;
+} ParallelSlice;
+
+static void *runSlice(void *arg) {
+    ParallelSlice *slice = (ParallelSlice*)arg;
+    slice->fn(slice->begin, slice->end, slice->worker, slice->context);
+    return NULL;
+}
+
+void setDefaultThreadCount(int numThreads) {
+    gDefaultThreads = numThreads > 0 ? numThreads : 0;
+}
+
+int getDefaultThreadCount(void) {
+    if (gDefaultThreads > 0) {
+        return gDefaultThreads;
+    }
+
+    const char *env = getenv("NB_THREADS");
+    if (env != NULL && atoi(env) > 0) {
+        return atoi(env);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int parallelWorkerCount(uint32_t n, int numThreads) {
+    int workers = numThreads > 0 ? numThreads : getDefaultThreadCount();
+    if ((uint32_t)workers > n) {
+        workers = n > 0 ? (int)n : 1;
+    }
+    return workers;
+}
+
+void parallelFor(uint32_t n, int numThreads, ParallelWorkFn fn, void *context) {
+    int workers = parallelWorkerCount(n, numThreads);
+    if (workers == 1) {
+        fn(0, n, 0, context);
+        return;
+    }
+
+    ParallelSlice slices[workers];
+    pthread_t threads[workers];
+    int started[workers];
+
+    for (int w = 0; w < workers; w++) {
+        slices[w].fn = fn;
+        slices[w].context = context;
+        slices[w].begin = (uint32_t)((uint64_t)n * w / workers);
+        slices[w].end = (uint32_t)((uint64_t)n * (w + 1) / workers);
+        slices[w].worker = w;
+    }
+
+    // Worker 0 runs here; a slice whose thread can't be started also runs here
+    for (int w = 1; w < workers; w++) {
+        started[w] = pthread_create(&threads[w], NULL, runSlice, &slices[w]) == 0;
+        if (!started[w]) {
+            printf("Warning: failed to start worker thread %d, running it inline\n", w);
+        }
+    }
+
+    runSlice(&slices[0]);
+
+    for (int w = 1; w < workers; w++) {
+        if (started[w]) {
+            pthread_join(threads[w], NULL);
+        } else {
+            runSlice(&slices[w]);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+
+// Work function: processes items [begin, end) as worker number `worker`
+typedef void (*ParallelWorkFn)(uint32_t begin, uint32_t end, int worker, void *context);
+
+// Override the default thread count (0 restores the automatic choice)
+void setDefaultThreadCount(int numThreads);
+
+// Default thread count: setDefaultThreadCount, else NB_THREADS from the
+// environment, else the number of online CPUs
+int getDefaultThreadCount(void);
+
+// Number of workers parallelFor will use for n items; size per-worker
+// buffers with this. numThreads <= 0 means the default thread count.
+int parallelWorkerCount(uint32_t n, int numThreads);
+
+// Split [0, n) into contiguous slices, one per worker, and run fn on each
+// slice from its own thread. Worker 0 runs on the calling thread. Returns
+// once every slice is done.
+void parallelFor(uint32_t n, int numThreads, ParallelWorkFn fn, void *context);
+
+#endif // PARALLEL_H
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prediction_worker.h"
+
+// Flag on Mailbox.slot marking a buffer the reader hasn't taken yet
+#define MAILBOX_FRESH 0x4
+#define MAILBOX_INDEX 0x3
+
+// Softmax temperature for the displayed confidences; higher values give a softer distribution
+#define CONFIDENCE_TEMPERATURE 2.5
+
+static void initMailbox(Mailbox *mailbox) {
+    SDL_AtomicSet(&mailbox->slot, 1);
+    mailbox->writeIndex = 0;
+    mailbox->readIndex = 2;
+}
+
+// Publish the writer's buffer and take over the one that was in the slot
+static void postMailbox(Mailbox *mailbox) {
+    int previous = SDL_AtomicSet(&mailbox->slot, mailbox->writeIndex | MAILBOX_FRESH);
+    mailbox->writeIndex = previous & MAILBOX_INDEX;
+}
+
+// Swap the reader's buffer for the slot's if the slot holds an unread one.
+// Only the reader clears MAILBOX_FRESH, so the slot is still fresh when
+// swapped (possibly with an even newer buffer).
+static int takeMailbox(Mailbox *mailbox) {
+    if (!(SDL_AtomicGet(&mailbox->slot) & MAILBOX_FRESH)) {
+        return 0;
+    }
+    int previous = SDL_AtomicSet(&mailbox->slot, mailbox->readIndex);
+    mailbox->readIndex = previous & MAILBOX_INDEX;
+    return 1;
+}
+
+// The whole prediction for one canvas snapshot; no heap allocation
+static void computePrediction(PredictionWorker *worker, const PredictionRequest *request,
+                              PredictionResult *result) {
+    ClassifierScratch *scratch = &worker->scratch;
+    ClassifierResult classified;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    result->sequence = request->sequence;
+    result->inputTime = request->inputTime;
+    result->prediction = -1;
+    result->cellsRecomputed = 0;
+    result->viz.hasData = 0;
+    memset(result->confidence, 0, sizeof(result->confidence));
+
+    if (!classifyImage(worker->model, request->canvas, scratch, &classified)) {
+        memset(result->processedCanvas, 0, sizeof(result->processedCanvas));
+        result->computeMs = 0.0;
+        return;
+    }
+    result->prediction = classified.prediction;
+    result->cellsRecomputed = classified.cellsRecomputed;
+    memcpy(result->processedCanvas, scratch->image, sizeof(result->processedCanvas));
+    memcpy(result->confidence, scratch->confidence, worker->numClasses * sizeof(double));
+
+    if (request->visualize) {
+        visualizeHOGFeatures(worker->model, scratch->image, scratch->features, classified.prediction, &result->viz);
+    }
+    result->computeMs = 1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+static int predictionThread(void *data) {
+    PredictionWorker *worker = (PredictionWorker*)data;
+
+    while (1) {
+        SDL_SemWait(worker->wakeup);
+        if (SDL_AtomicGet(&worker->quit)) {
+            break;
+        }
+
+        // Several posts may have woken us for one request; later wakeups find nothing new
+        if (!takeMailbox(&worker->requestBox)) {
+            continue;
+        }
+        computePrediction(worker, &worker->requests[worker->requestBox.readIndex],
+                          &worker->results[worker->resultBox.writeIndex]);
+        postMailbox(&worker->resultBox);
+    }
+
+    return 0;
+}
+
+PredictionWorker *startPredictionWorker(const NaiveBayesModel *model, int numClasses) {
+    PredictionWorker *worker = (PredictionWorker*)calloc(1, sizeof(PredictionWorker));
+    if (worker == NULL) {
+        printf("Failed to allocate memory for the prediction worker\n");
+        return NULL;
+    }
+    worker->model = model;
+    worker->numClasses = numClasses;
+    worker->nextSequence = 1;
+    initMailbox(&worker->requestBox);
+    initMailbox(&worker->resultBox);
+    SDL_AtomicSet(&worker->quit, 0);
+
+    if (!initClassifierScratch(&worker->scratch, model, 28, 28, CELL_SIZE, NUM_BINS)) {
+        free(worker);
+        return NULL;
+    }
+    worker->scratch.preprocess = true;
+    worker->scratch.incremental = true;
+    worker->scratch.temperature = CONFIDENCE_TEMPERATURE;
+
+    worker->wakeup = SDL_CreateSemaphore(0);
+    if (worker->wakeup == NULL) {
+        printf("Failed to create prediction semaphore! SDL_Error: %s\n", SDL_GetError());
+        freeClassifierScratch(&worker->scratch);
+        free(worker);
+        return NULL;
+    }
+    worker->thread = SDL_CreateThread(predictionThread, "prediction", worker);
+    if (worker->thread == NULL) {
+        printf("Failed to start prediction thread! SDL_Error: %s\n", SDL_GetError());
+        SDL_DestroySemaphore(worker->wakeup);
+        freeClassifierScratch(&worker->scratch);
+        free(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+uint32_t requestPrediction(PredictionWorker *worker, const uint8_t *canvas, int visualize, Uint64 inputTime) {
+    PredictionRequest *request = &worker->requests[worker->requestBox.writeIndex];
+    request->sequence = worker->nextSequence++;
+    request->visualize = visualize;
+    request->inputTime = inputTime;
+    memcpy(request->canvas, canvas, sizeof(request->canvas));
+
+    postMailbox(&worker->requestBox);
+    SDL_SemPost(worker->wakeup);
+    return request->sequence;
+}
+
+const PredictionResult *takePredictionResult(PredictionWorker *worker) {
+    if (!takeMailbox(&worker->resultBox)) {
+        return NULL;
+    }
+    return &worker->results[worker->resultBox.readIndex];
+}
+
+void stopPredictionWorker(PredictionWorker *worker) {
+    if (worker == NULL) {
+        return;
+    }
+    SDL_AtomicSet(&worker->quit, 1);
+    SDL_SemPost(worker->wakeup);
+    SDL_WaitThread(worker->thread, NULL);
+    SDL_DestroySemaphore(worker->wakeup);
+    freeClassifierScratch(&worker->scratch);
+    free(worker);
+}
@@ -0,0 +1,78 @@
+#ifndef PREDICTION_WORKER_H
+#define PREDICTION_WORKER_H
+
+#include <SDL2/SDL.h>
+#include "naive_bayes.h"
+#include "ui_drawer.h"
+#include "classifier.h"
+
+// Canvas snapshot handed to the worker
+typedef struct {
+    uint32_t sequence;              // Increases with every request, starting at 1
+    int visualize;                  // Also build the HOG visualization
+    Uint64 inputTime;               // Performance counter at the input this snapshot reflects
+    uint8_t canvas[28*28];
+} PredictionRequest;
+
+// What the worker publishes for one request
+typedef struct {
+    uint32_t sequence;              // Sequence of the request this answers
+    Uint64 inputTime;               // Copied from the request
+    double computeMs;               // Time the worker spent on the request
+    int cellsRecomputed;            // HOG cells that changed since the previous request
+    int prediction;                 // -1 if the prediction failed
+    double confidence[26];          // Softened class probabilities
+    uint8_t processedCanvas[28*28]; // Canvas after preprocessCanvas
+    HOGVisualization viz;           // Only filled when the request asked for it
+} PredictionResult;
+
+// Lock-free single-slot mailbox between one writer and one reader, over
+// three buffers: the writer fills its own buffer and swaps it into the slot,
+// the reader swaps its own buffer for the slot's. A message the reader hasn't
+// taken yet is replaced by the next one, since only the latest matters, and
+// neither side ever waits for the other.
+typedef struct {
+    SDL_atomic_t slot;              // Buffer in the slot, | MAILBOX_FRESH while unread
+    int writeIndex;                 // Buffer the writer owns
+    int readIndex;                  // Buffer the reader owns
+} Mailbox;
+
+// Runs preprocessing, HOG extraction, scoring and the HOG visualization on
+// its own thread, so the event/render thread never waits for the model.
+// The UI thread posts canvas snapshots and picks up results; requests
+// posted while the worker is busy replace each other, and the worker only
+// ever handles the newest one.
+typedef struct PredictionWorker {
+    const NaiveBayesModel *model;   // Read-only while the worker runs
+    int numClasses;
+
+    PredictionRequest requests[3];
+    Mailbox requestBox;             // UI thread -> worker
+    PredictionResult results[3];
+    Mailbox resultBox;              // Worker -> UI thread
+
+    // Worker thread only, in incremental mode: keeps the last processed
+    // canvas, so the next request only recomputes the HOG cells its strokes changed
+    ClassifierScratch scratch;
+
+    SDL_sem *wakeup;                // Posted with every request and on shutdown
+    SDL_atomic_t quit;
+    SDL_Thread *thread;
+    uint32_t nextSequence;          // UI thread only
+} PredictionWorker;
+
+// Start the worker thread. Returns NULL on failure.
+PredictionWorker *startPredictionWorker(const NaiveBayesModel *model, int numClasses);
+
+// Post a snapshot of canvas and return its sequence number. Never blocks;
+// an earlier request the worker hasn't started on yet is dropped.
+uint32_t requestPrediction(PredictionWorker *worker, const uint8_t *canvas, int visualize, Uint64 inputTime);
+
+// The newest result published since the last call, or NULL if there is none.
+// The result stays valid until the next call.
+const PredictionResult *takePredictionResult(PredictionWorker *worker);
+
+// Stop the worker thread and free it
+void stopPredictionWorker(PredictionWorker *worker);
+
+#endif // PREDICTION_WORKER_H
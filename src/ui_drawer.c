@@ -5,6 +5,7 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include "ui_drawer.h"
+#include "prediction_worker.h"
 #include "hog.h"
 
 #define WINDOW_WIDTH 800
@@ -15,8 +16,16 @@
 
 // Prediction constants
 #define PREDICTION_DELAY 500   // milliseconds to wait after drawing stops before predicting
-#define CELL_SIZE 4           // MUST match the cell size used in training
-#define NUM_BINS 9
+// Streaming predictions should show up within one frame of the input. A
+// model that takes longer than this per request can't keep up with one
+// request per frame, so streaming then waits for each answer before posting
+// the next snapshot. The latency display turns red past it.
+#define LATENCY_BUDGET_MS 16.0
+
+// Texture colors (RGBA8888)
+#define TEXTURE_PAPER 0xFFFFFFFFu
+#define TEXTURE_INK 0x000000FFu
+#define TEXTURE_HOG_INK 0xDCDCDCFFu
 
 // Colors
 SDL_Color WHITE = {255, 255, 255, 255};
@@ -55,6 +64,15 @@ char getLabelChar(int label, int showingLetters) {
         return '0' + label;
     }
 }
+
+// Drop whatever the worker is still computing for the old drawing; only
+// requests posted from now on can be shown
+static void discardPendingPrediction(DrawingUI *ui) {
+    if (ui->pendingSequence != 0) {
+        ui->epochSequence = ui->pendingSequence;
+    }
+    ui->pendingSequence = 0;
+}
 // Initialize the drawing UI
 int initUI(DrawingUI *ui, NaiveBayesModel *model, int numClasses, int showLetters) {
     // Initialize SDL
@@ -107,11 +125,19 @@ int initUI(DrawingUI *ui, NaiveBayesModel *model, int numClasses, int showLetter
         return 0;
     }
 
-    // Create canvas texture
+    // Create the image textures; the renderer scales them up to their views
     ui->canvasTexture = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888,
-                                        SDL_TEXTUREACCESS_TARGET, 28, 28);
-    if (ui->canvasTexture == NULL) {
-        printf("Canvas texture could not be created! SDL_Error: %s\n", SDL_GetError());
+                                        SDL_TEXTUREACCESS_STREAMING, 28, 28);
+    ui->processedTexture = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                           SDL_TEXTUREACCESS_STREAMING, 28, 28);
+    ui->hogTexture = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                     SDL_TEXTUREACCESS_STREAMING, 28, 28);
+    ui->referenceTexture = SDL_CreateTexture(ui->renderer, SDL_PIXELFORMAT_RGBA8888,
+                                           SDL_TEXTUREACCESS_STREAMING,
+                                           28 * gReferenceSamples.numSamplesPerClass, 28);
+    if (ui->canvasTexture == NULL || ui->processedTexture == NULL ||
+        ui->hogTexture == NULL || ui->referenceTexture == NULL) {
+        printf("Canvas textures could not be created! SDL_Error: %s\n", SDL_GetError());
         return 0;
     }
 
@@ -125,14 +151,28 @@ int initUI(DrawingUI *ui, NaiveBayesModel *model, int numClasses, int showLetter
     ui->numClasses = numClasses;
     ui->showingLetters = showLetters;
     ui->prediction = -1;  // No prediction yet
-    ui->lastFeatures = NULL;  // Initialize lastFeatures
-    ui->lastFeaturesCount = 0;  // Initialize lastFeaturesCount
     memset(ui->confidence, 0, sizeof(ui->confidence));
+    ui->pendingSequence = 0;
+    ui->epochSequence = 0;
+    ui->lastShownSequence = 0;
+    ui->streaming = 1;
+    ui->lastInputTime = 0;
+    ui->latencyMs = -1.0;
+    ui->computeMs = 0.0;
+    ui->cellsRecomputed = 0;
+    ui->hogChanged = 1;
+    ui->referenceLetter = -1;
 
     // Initialize prediction flags
     canvasDirty = 0;
     lastDrawTime = 0;
 
+    // Predictions run on their own thread so drawing never waits for the model
+    ui->worker = startPredictionWorker(model, numClasses);
+    if (ui->worker == NULL) {
+        return 0;
+    }
+
     // Verify feature dimensions are correct
     int expectedFeatures = (28/CELL_SIZE) * (28/CELL_SIZE) * NUM_BINS;
     if (model->numFeatures != expectedFeatures) {
@@ -149,15 +189,18 @@ int initUI(DrawingUI *ui, NaiveBayesModel *model, int numClasses, int showLetter
 
 // Clean up resources
 void cleanupUI(DrawingUI *ui) {
-    // Free any allocated feature memory
-    if (ui->lastFeatures != NULL) {
-        free(ui->lastFeatures);
-        ui->lastFeatures = NULL;
-    }
+    // Stop the worker first; it reads the model and must be done before anything is freed
+    stopPredictionWorker(ui->worker);
+    ui->worker = NULL;
 
-    if (ui->canvasTexture != NULL) {
-        SDL_DestroyTexture(ui->canvasTexture);
-        ui->canvasTexture = NULL;
+    SDL_Texture **textures[] = {
+        &ui->canvasTexture, &ui->processedTexture, &ui->hogTexture, &ui->referenceTexture
+    };
+    for (size_t i = 0; i < sizeof(textures) / sizeof(textures[0]); i++) {
+        if (*textures[i] != NULL) {
+            SDL_DestroyTexture(*textures[i]);
+            *textures[i] = NULL;
+        }
     }
 
     if (ui->renderer != NULL) {
@@ -245,10 +288,18 @@ int isInsideButton(int x, int y, int btnX, int btnY, int btnW, int btnH) {
     return (x >= btnX && x <= btnX + btnW && y >= btnY && y <= btnY + btnH);
 }
 
-// Check if we should attempt prediction
-int shouldPredict(void) {
+// Check if we should attempt prediction. Streaming predicts on every frame
+// that changed the canvas; otherwise wait until drawing has paused.
+int shouldPredict(const DrawingUI *ui) {
     if (!canvasDirty)
         return 0;
+    if (ui->streaming) {
+        // Over budget, requests posted while one is in flight would only
+        // replace each other; hold the snapshot until the answer is in.
+        // The canvas stays dirty, so it goes out on a later frame.
+        int overBudget = ui->computeMs > LATENCY_BUDGET_MS;
+        return !(overBudget && ui->drawing && ui->pendingSequence != 0);
+    }
 
     Uint32 currentTime = SDL_GetTicks();
     return (currentTime - lastDrawTime > PREDICTION_DELAY);
@@ -259,6 +310,11 @@ int processEvents(DrawingUI *ui) {
     int wasDrawing = ui->drawing;
 
     while (SDL_PollEvent(&e) != 0) {
+        // Moving the mouse without drawing changes nothing on screen
+        if (e.type != SDL_MOUSEMOTION || ui->drawing) {
+            ui->needsRedraw = 1;
+        }
+
         if (e.type == SDL_QUIT) {
             return 0;  // Exit
         }
@@ -274,6 +330,7 @@ int processEvents(DrawingUI *ui) {
                 // Reset prediction state when drawing starts
                 if (!wasDrawing) {
                     ui->prediction = -1;  // Clear prediction
+                    discardPendingPrediction(ui);  // Ignore any prediction still in flight
                     memset(ui->confidence, 0, sizeof(ui->confidence));
                     ui->showProcessed = 0; // Hide processed view when drawing new character
                 }
@@ -296,7 +353,9 @@ int processEvents(DrawingUI *ui) {
 
                 // Mark canvas as dirty and update last draw time
                 canvasDirty = 1;
+                ui->canvasChanged = 1;
                 lastDrawTime = SDL_GetTicks();
+                ui->lastInputTime = SDL_GetPerformanceCounter();
             }
 
             // Check if click is on "Clear" button
@@ -315,6 +374,11 @@ int processEvents(DrawingUI *ui) {
             }
         }
         else if (e.type == SDL_MOUSEBUTTONUP) {
+            // Streaming requests skip the HOG visualization while the stroke
+            // is in progress; ask once more for the finished stroke
+            if (ui->drawing && ui->streaming) {
+                canvasDirty = 1;
+            }
             ui->drawing = 0;
         }
         else if (e.type == SDL_MOUSEMOTION && ui->drawing) {
@@ -343,7 +407,9 @@ int processEvents(DrawingUI *ui) {
 
                 // Mark canvas as dirty and update last draw time
                 canvasDirty = 1;
+                ui->canvasChanged = 1;
                 lastDrawTime = SDL_GetTicks();
+                ui->lastInputTime = SDL_GetPerformanceCounter();
             }
         }
         else if (e.type == SDL_KEYDOWN) {
@@ -351,15 +417,28 @@ int processEvents(DrawingUI *ui) {
             if (e.key.keysym.sym == SDLK_t) {
                 ui->showProcessed = !ui->showProcessed;
             }
+            // Press 'S' to switch between streaming and predicting after a pause
+            if (e.key.keysym.sym == SDLK_s) {
+                ui->streaming = !ui->streaming;
+                printf("Prediction mode: %s\n", ui->streaming ? "streaming" : "after drawing pauses");
+            }
         }
     }
 
     // Check if we should attempt prediction
-    if (shouldPredict()) {
+    if (shouldPredict(ui)) {
         processPrediction(ui);
         canvasDirty = 0;  // Canvas has been processed
     }
 
+    // Pick up whatever the worker has finished since the last frame
+    applyPredictionResult(ui);
+
+    // The "Predicting in" countdown ticks until the prediction is requested
+    if (canvasDirty && !ui->drawing) {
+        ui->needsRedraw = 1;
+    }
+
     return 1;  // Continue running
 }
 
@@ -384,72 +463,74 @@ void cycleVisualizationMode(DrawingUI *ui) {
     }
 }
 
+// Upload a grayscale image to part of an RGBA texture: pixels brighter than
+// threshold become ink, the rest paper
+static void uploadImageTexture(SDL_Texture *texture, const SDL_Rect *area, const uint8_t *image,
+                               uint8_t threshold, Uint32 ink) {
+    Uint32 pixels[28*28];
+    for (int i = 0; i < 28 * 28; i++) {
+        pixels[i] = image[i] > threshold ? ink : TEXTURE_PAPER;
+    }
+    SDL_UpdateTexture(texture, area, pixels, 28 * sizeof(Uint32));
+}
+
+int isUIIdle(const DrawingUI *ui) {
+    return !ui->needsRedraw && !ui->drawing && !canvasDirty && ui->pendingSequence == 0;
+}
+
 // Draw the canvas and UI elements
 void renderUI(DrawingUI *ui) {
+    // The last frame is still on screen when nothing changed
+    if (!ui->needsRedraw) {
+        return;
+    }
+    ui->needsRedraw = 0;
+
+    // Bring the textures of the views up to date with their images
+    if (ui->canvasChanged) {
+        uploadImageTexture(ui->canvasTexture, NULL, ui->canvas, 0, TEXTURE_INK);
+        ui->canvasChanged = 0;
+    }
+    if (ui->processedChanged) {
+        uploadImageTexture(ui->processedTexture, NULL, ui->processedCanvas, 0, TEXTURE_INK);
+        ui->processedChanged = 0;
+    }
+    if (ui->hogChanged) {
+        uploadImageTexture(ui->hogTexture, NULL, gHOGViz.originalImage, 50, TEXTURE_HOG_INK);
+        ui->hogChanged = 0;
+    }
+    if (ui->vizMode == VIZ_MODE_REFERENCE && gReferenceSamples.loaded &&
+        ui->prediction >= 0 && ui->referenceLetter != ui->prediction) {
+        for (int i = 0; i < gReferenceSamples.numSamplesPerClass; i++) {
+            SDL_Rect area = {i * 28, 0, 28, 28};
+            uploadImageTexture(ui->referenceTexture, &area,
+                               gReferenceSamples.samples[ui->prediction][i], 50, TEXTURE_INK);
+        }
+        ui->referenceLetter = ui->prediction;
+    }
+
     // Clear the renderer
     SDL_SetRenderDrawColor(ui->renderer, 240, 240, 240, 255);
     SDL_RenderClear(ui->renderer);
 
-    // Draw canvas background (original canvas)
+    // Draw the canvas (original canvas), scaled up to display size
     SDL_Rect canvasRect = {CANVAS_X, CANVAS_Y, CANVAS_SIZE, CANVAS_SIZE};
-    SDL_SetRenderDrawColor(ui->renderer, 255, 255, 255, 255);
-    SDL_RenderFillRect(ui->renderer, &canvasRect);
+    SDL_RenderCopy(ui->renderer, ui->canvasTexture, NULL, &canvasRect);
 
     // Draw canvas border
     SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
     SDL_RenderDrawRect(ui->renderer, &canvasRect);
 
-    // Draw the pixels from our canvas data
-    for (int y = 0; y < 28; y++) {
-        for (int x = 0; x < 28; x++) {
-            if (ui->canvas[y * 28 + x] > 0) {
-                // Scale up to display size
-                SDL_Rect pixelRect = {
-                    CANVAS_X + x * CANVAS_SIZE / 28,
-                    CANVAS_Y + y * CANVAS_SIZE / 28,
-                    CANVAS_SIZE / 28 + 1,  // +1 to avoid gaps
-                    CANVAS_SIZE / 28 + 1
-                };
-
-                // Set color based on pixel intensity
-                int intensity = ui->canvas[y * 28 + x];
-                SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, intensity);
-                SDL_RenderFillRect(ui->renderer, &pixelRect);
-            }
-        }
-    }
-
     // If we have a processed canvas, show it
     if (ui->showProcessed) {
-        // Draw processed canvas background
+        // Draw the processed canvas
         SDL_Rect processedRect = {CANVAS_X, CANVAS_Y + CANVAS_SIZE + 20, CANVAS_SIZE, CANVAS_SIZE};
-        SDL_SetRenderDrawColor(ui->renderer, 255, 255, 255, 255);
-        SDL_RenderFillRect(ui->renderer, &processedRect);
+        SDL_RenderCopy(ui->renderer, ui->processedTexture, NULL, &processedRect);
 
         // Draw processed canvas border
         SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, 255);
         SDL_RenderDrawRect(ui->renderer, &processedRect);
 
-        // Draw processed pixels
-        for (int y = 0; y < 28; y++) {
-            for (int x = 0; x < 28; x++) {
-                if (ui->processedCanvas[y * 28 + x] > 0) {
-                    // Scale up to display size
-                    SDL_Rect pixelRect = {
-                        CANVAS_X + x * CANVAS_SIZE / 28,
-                        (CANVAS_Y + CANVAS_SIZE + 20) + y * CANVAS_SIZE / 28,
-                        CANVAS_SIZE / 28 + 1,  // +1 to avoid gaps
-                        CANVAS_SIZE / 28 + 1
-                    };
-
-                    // Set color based on pixel intensity
-                    int intensity = ui->processedCanvas[y * 28 + x];
-                    SDL_SetRenderDrawColor(ui->renderer, 0, 0, 0, intensity);
-                    SDL_RenderFillRect(ui->renderer, &pixelRect);
-                }
-            }
-        }
-
         // Label the processed canvas
         renderText(ui->renderer, CANVAS_X, CANVAS_Y + CANVAS_SIZE + 5, "Preprocessed", BLACK);
     }
@@ -464,7 +545,13 @@ void renderUI(DrawingUI *ui) {
 
     // Display instructions
     renderText(ui->renderer, 350, 60, "Draw a letter in the box", BLACK);
-    if (canvasDirty && !ui->drawing) {
+    if (ui->latencyMs >= 0 && (ui->streaming || !canvasDirty)) {
+        // Measured from the input event to the result being picked up
+        char latencyText[64];
+        sprintf(latencyText, "Latency: %.1f ms (model %.2f ms, %d cells)",
+                ui->latencyMs, ui->computeMs, ui->cellsRecomputed);
+        renderText(ui->renderer, 350, 90, latencyText, ui->latencyMs <= LATENCY_BUDGET_MS ? GREEN : RED);
+    } else if (canvasDirty && !ui->drawing) {
         // Show that we're waiting to predict
         Uint32 currentTime = SDL_GetTicks();
         Uint32 timeLeft = (lastDrawTime + PREDICTION_DELAY) - currentTime;
@@ -557,7 +644,7 @@ void renderUI(DrawingUI *ui) {
     case VIZ_MODE_REFERENCE:
         // Show reference samples for the predicted letter
         if (gReferenceSamples.loaded) {
-            renderReferenceSamples(ui->renderer, 
+            renderReferenceSamples(ui->renderer, ui->referenceTexture,
                                     350, 450, 
                                     300, 100, 
                                     ui->prediction);
@@ -568,23 +655,9 @@ void renderUI(DrawingUI *ui) {
         break;
         
     case VIZ_MODE_HOG:
-        // Calculate and show HOG feature visualization
-        if (ui->lastFeatures == NULL) {
-            // Allocate space for features if not already done
-            ui->lastFeatures = (double*)malloc(ui->model->numFeatures * sizeof(double));
-            if (ui->lastFeatures == NULL) {
-                renderText(ui->renderer, 350, 450, 
-                            "Failed to allocate memory for feature viz", RED);
-                break;
-            }
-            
-            // We'll store features during processPrediction()
-            ui->lastFeaturesCount = ui->model->numFeatures;
-        }
-        
-        // Visualize the HOG features
-        if (ui->lastFeatures != NULL && gHOGViz.hasData) {
-            renderHOGVisualization(ui->renderer, 350, 450, 200);
+        // Show the HOG feature visualization the worker built
+        if (gHOGViz.hasData) {
+            renderHOGVisualization(ui->renderer, ui->hogTexture, 350, 450, 200);
         } else {
             renderText(ui->renderer, 350, 450, 
                         "HOG visualization not available", RED);
@@ -603,137 +676,63 @@ void renderUI(DrawingUI *ui) {
 void clearCanvas(DrawingUI *ui) {
     memset(ui->canvas, 0, 28*28);
     memset(ui->processedCanvas, 0, 28*28);  // Also clear the processed canvas
+    ui->canvasChanged = 1;
+    ui->processedChanged = 1;
+    ui->needsRedraw = 1;
     ui->showProcessed = 0;                  // Hide the processed view
     ui->prediction = -1;                    // Clear prediction
+    discardPendingPrediction(ui);           // Ignore any prediction still in flight
     memset(ui->confidence, 0, sizeof(ui->confidence));
     canvasDirty = 0;                        // Canvas is clean
 }
 
-void preprocessCanvas(uint8_t *canvas, uint8_t *processedCanvas) {
-    // Step 1: Find the bounding box of the drawn character
-    int minX = 28, minY = 28, maxX = 0, maxY = 0;
-    int hasContent = 0;
-
-    for (int y = 0; y < 28; y++) {
-        for (int x = 0; x < 28; x++) {
-            if (canvas[y * 28 + x] > 50) {
-                hasContent = 1;
-                if (x < minX) minX = x;
-                if (y < minY) minY = y;
-                if (x > maxX) maxX = x;
-                if (y > maxY) maxY = y;
-            }
-        }
-    }
-
-    // If no content, return empty canvas
-    if (!hasContent) {
-        memset(processedCanvas, 0, 28 * 28);
-        return;
-    }
-
-    // Step 2: Initialize processed canvas to zeros
-    memset(processedCanvas, 0, 28 * 28);
-
-    // Step 3: Calculate dimensions and center offset
-    int width = maxX - minX + 1;
-    int height = maxY - minY + 1;
-    
-    // Use a more conservative padding (10% instead of 20%)
-    int paddingX = width / 10;
-    int paddingY = height / 10;
-    
-    // Calculate new dimensions with padding
-    int newWidth = width + 2 * paddingX;
-    int newHeight = height + 2 * paddingY;
-    
-    // Determine scaling factor to fit in 28x28 while preserving aspect ratio
-    float scaleX = 28.0f / newWidth;
-    float scaleY = 28.0f / newHeight;
-    float scale = (scaleX < scaleY) ? scaleX : scaleY;
-    
-    // Calculate the final dimensions after scaling
-    int finalWidth = (int)(width * scale);
-    int finalHeight = (int)(height * scale);
-    
-    // Calculate centering offsets
-    int offsetX = (28 - finalWidth) / 2;
-    int offsetY = (28 - finalHeight) / 2;
-    
-    // Ensure offsets are not negative
-    offsetX = (offsetX < 0) ? 0 : offsetX;
-    offsetY = (offsetY < 0) ? 0 : offsetY;
-
-    // Step 4: Scale and center the content with proper aspect ratio
-    for (int y = 0; y < finalHeight; y++) {
-        for (int x = 0; x < finalWidth; x++) {
-            // Map the destination (x,y) back to source coordinates
-            int srcX = minX + (int)(x / scale);
-            int srcY = minY + (int)(y / scale);
-            
-            // Ensure source coordinates are in bounds
-            if (srcX >= 0 && srcX < 28 && srcY >= 0 && srcY < 28) {
-                // Copy pixel to the centered position in the processed canvas
-                processedCanvas[(offsetY + y) * 28 + (offsetX + x)] = canvas[srcY * 28 + srcX];
-            }
-        }
-    }
-
-    // Step 5: Apply thresholding and normalization
-    for (int i = 0; i < 28 * 28; i++) {
-        // Binary thresholding
-        processedCanvas[i] = (processedCanvas[i] > 30) ? 255 : 0;
-    }
-}
 // Replace the entire visualizeHOGFeatures() function with this improved version
-void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClass) {
+// Runs on the prediction worker, so it fills viz rather than gHOGViz
+void visualizeHOGFeatures(const NaiveBayesModel *model, const uint8_t *processedCanvas,
+                          const double *features, uint8_t predictedClass, HOGVisualization *viz) {
     // Clear the visualization
-    memset(&gHOGViz.featureMap, 0, sizeof(gHOGViz.featureMap));
-    memset(&gHOGViz.cellStrengths, 0, sizeof(gHOGViz.cellStrengths));
-    memcpy(gHOGViz.originalImage, ui->processedCanvas, 28*28); // Store original image
-    gHOGViz.hasData = 0;  // Set to 0 initially, will set to 1 when successful
-    
-    // Early return if invalid inputs
-    if (features == NULL || ui->model == NULL) {
-        printf("Invalid inputs for HOG visualization\n");
-        return;
-    }
+    memset(&viz->featureMap, 0, sizeof(viz->featureMap));
+    memset(&viz->cellStrengths, 0, sizeof(viz->cellStrengths));
+    memcpy(viz->originalImage, processedCanvas, 28*28); // Store original image
+    viz->hasData = 0;  // Set to 0 initially, will set to 1 when successful
     
     // Get parameters
     int cellSize = CELL_SIZE;  // IMPORTANT: Must match training
     int numBins = NUM_BINS;
     int cellsX = 28 / cellSize;
     int cellsY = 28 / cellSize;
-    
-    // Create an array to store importance of each feature
-    double *featureImportance = (double*)malloc(ui->model->numFeatures * sizeof(double));
-    if (featureImportance == NULL) {
-        printf("Failed to allocate memory for feature importance\n");
+
+    // Early return if invalid inputs
+    if (features == NULL || model == NULL || model->numFeatures != (uint32_t)(cellsX * cellsY * numBins)) {
+        printf("Invalid inputs for HOG visualization\n");
         return;
     }
     
+    // Importance of each feature; on the stack, since this runs on the worker for every visualized prediction
+    double featureImportance[(28/CELL_SIZE) * (28/CELL_SIZE) * NUM_BINS];
+    
     // Calculate feature importance for the predicted class
-    for (int f = 0; f < ui->model->numFeatures; f++) {
+    for (int f = 0; f < model->numFeatures; f++) {
         double featureVal = features[f];
         
         // Ensure feature value is in valid range
         featureVal = (featureVal < 0) ? 0 : (featureVal > 1.0 ? 1.0 : featureVal);
         
         // Determine which bin the orientation falls into
-        int bin = (int)(featureVal / ui->model->binWidth);
-        bin = (bin < 0) ? 0 : (bin >= ui->model->numBins ? ui->model->numBins - 1 : bin);
+        int bin = (int)(featureVal / model->binWidth);
+        bin = (bin < 0) ? 0 : (bin >= model->numBins ? model->numBins - 1 : bin);
         
         // Calculate importance based on likelihood ratio
         double importance = 0;
         
         // Compare this feature's probability for the predicted class vs. average of other classes
-        double probForClass = ui->model->featureProb[predictedClass][f][bin];
+        double probForClass = exp(featureLogProbability(model, predictedClass, f, bin));
         double avgProbOtherClasses = 0;
         int numOtherClasses = 0;
         
-        for (int c = 0; c < ui->model->numClasses; c++) {
+        for (int c = 0; c < model->numClasses; c++) {
             if (c != predictedClass) {
-                avgProbOtherClasses += ui->model->featureProb[c][f][bin];
+                avgProbOtherClasses += exp(featureLogProbability(model, c, f, bin));
                 numOtherClasses++;
             }
         }
@@ -758,7 +757,7 @@ void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClas
     }
     
     // Map feature importance back to image pixels and store cell strengths
-    for (int f = 0; f < ui->model->numFeatures; f++) {
+    for (int f = 0; f < model->numFeatures; f++) {
         // Calculate which cell this feature belongs to
         int binIndex = f % numBins;
         int cellIndex = f / numBins;
@@ -771,7 +770,7 @@ void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClas
         }
         
         // Store cell strength for this orientation bin
-        gHOGViz.cellStrengths[cellY][cellX][binIndex] = featureImportance[f];
+        viz->cellStrengths[cellY][cellX][binIndex] = featureImportance[f];
         
         // For each pixel in this cell, add the feature importance
         for (int y = 0; y < cellSize; y++) {
@@ -783,7 +782,7 @@ void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClas
                     // Scale by bin index to visualize orientation
                     // This will make different orientations appear with different intensities
                     double scaledImportance = featureImportance[f] * (1.0 + 0.2 * binIndex);
-                    gHOGViz.featureMap[pixelY][pixelX] += scaledImportance;
+                    viz->featureMap[pixelY][pixelX] += scaledImportance;
                 }
             }
         }
@@ -797,13 +796,13 @@ void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClas
     // Find min and max values
     for (int y = 0; y < 28; y++) {
         for (int x = 0; x < 28; x++) {
-            if (!hasNonZeroValues || gHOGViz.featureMap[y][x] != 0) {
+            if (!hasNonZeroValues || viz->featureMap[y][x] != 0) {
                 if (!hasNonZeroValues) {
-                    minVal = maxVal = gHOGViz.featureMap[y][x];
+                    minVal = maxVal = viz->featureMap[y][x];
                     hasNonZeroValues = 1;
                 } else {
-                    if (gHOGViz.featureMap[y][x] < minVal) minVal = gHOGViz.featureMap[y][x];
-                    if (gHOGViz.featureMap[y][x] > maxVal) maxVal = gHOGViz.featureMap[y][x];
+                    if (viz->featureMap[y][x] < minVal) minVal = viz->featureMap[y][x];
+                    if (viz->featureMap[y][x] > maxVal) maxVal = viz->featureMap[y][x];
                 }
             }
         }
@@ -814,16 +813,11 @@ void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClas
         for (int y = 0; y < 28; y++) {
             for (int x = 0; x < 28; x++) {
                 // Normalize to [0, 1]
-                gHOGViz.featureMap[y][x] = (gHOGViz.featureMap[y][x] - minVal) / (maxVal - minVal);
+                viz->featureMap[y][x] = (viz->featureMap[y][x] - minVal) / (maxVal - minVal);
             }
         }
-        gHOGViz.hasData = 1;  // Mark as successful
+        viz->hasData = 1;  // Mark as successful
     }
-    
-    // Free temporary memory
-    free(featureImportance);
-    
-    printf("HOG feature visualization created (min=%f, max=%f)\n", minVal, maxVal);
 }
 // Load reference samples from the training dataset
 int loadReferenceSamples(const char* imageFile, const char* labelFile) {
@@ -910,7 +904,7 @@ int loadReferenceSamples(const char* imageFile, const char* labelFile) {
     return 1;
 }
 // Replace the renderHOGVisualization() function with this version
-void renderHOGVisualization(SDL_Renderer *renderer, int x, int y, int size) {
+void renderHOGVisualization(SDL_Renderer *renderer, SDL_Texture *imageTexture, int x, int y, int size) {
     if (!gHOGViz.hasData) {
         // Draw placeholder if we don't have data
         SDL_Rect rect = {x, y, size, size};
@@ -923,26 +917,9 @@ void renderHOGVisualization(SDL_Renderer *renderer, int x, int y, int size) {
     // Draw title
     renderText(renderer, x, y - 30, "HOG Feature Visualization", BLACK);
     
-    // Draw background
+    // First, draw the original processed letter (light gray on white) as a background
     SDL_Rect bgRect = {x, y, size, size};
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    SDL_RenderFillRect(renderer, &bgRect);
-    
-    // First, draw the original processed letter as a background
-    for (int py = 0; py < 28; py++) {
-        for (int px = 0; px < 28; px++) {
-            if (gHOGViz.originalImage[py * 28 + px] > 50) {
-                // Scale pixel coordinates to display size
-                int dispX = x + px * size / 28;
-                int dispY = y + py * size / 28;
-                int pixSize = size / 28 + 1; // +1 to avoid gaps
-                
-                SDL_Rect pixRect = {dispX, dispY, pixSize, pixSize};
-                SDL_SetRenderDrawColor(renderer, 220, 220, 220, 255); // Light gray for background
-                SDL_RenderFillRect(renderer, &pixRect);
-            }
-        }
-    }
+    SDL_RenderCopy(renderer, imageTexture, NULL, &bgRect);
     
     // Now draw the HOG arrows overlaid on the image
     int cellSize = CELL_SIZE;
@@ -1032,7 +1009,8 @@ void renderHOGVisualization(SDL_Renderer *renderer, int x, int y, int size) {
     SDL_RenderDrawRect(renderer, &bgRect);
 }
 // Display reference samples for comparison
-void renderReferenceSamples(SDL_Renderer *renderer, int x, int y, int width, int height, int letterIndex) {
+void renderReferenceSamples(SDL_Renderer *renderer, SDL_Texture *samplesTexture,
+                            int x, int y, int width, int height, int letterIndex) {
     if (!gReferenceSamples.loaded || letterIndex < 0 || letterIndex >= 26) {
         return;
     }
@@ -1054,189 +1032,65 @@ void renderReferenceSamples(SDL_Renderer *renderer, int x, int y, int width, int
     for (int i = 0; i < gReferenceSamples.numSamplesPerClass; i++) {
         int sampleX = x + i * (sampleSize + spacing);
         
-        // Draw sample background
+        // Draw the sample
+        SDL_Rect sourceRect = {i * 28, 0, 28, 28};
         SDL_Rect sampleRect = {sampleX, y, sampleSize, sampleSize};
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        SDL_RenderFillRect(renderer, &sampleRect);
+        SDL_RenderCopy(renderer, samplesTexture, &sourceRect, &sampleRect);
         
         // Draw sample border
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderDrawRect(renderer, &sampleRect);
-        
-        // Draw the sample pixels
-        for (int sy = 0; sy < 28; sy++) {
-            for (int sx = 0; sx < 28; sx++) {
-                if (gReferenceSamples.samples[letterIndex][i][sy * 28 + sx] > 50) {
-                    SDL_Rect pixelRect = {
-                        sampleX + sx * sampleSize / 28,
-                        y + sy * sampleSize / 28,
-                        sampleSize / 28 + 1,
-                        sampleSize / 28 + 1
-                    };
-                    
-                    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-                    SDL_RenderFillRect(renderer, &pixelRect);
-                }
-            }
-        }
     }
 }
-// Process the current drawing and make a prediction
+// Hand a snapshot of the current drawing to the prediction worker. Returns
+// at once; applyPredictionResult shows the answer when it is ready.
 void processPrediction(DrawingUI *ui) {
-    // Preprocess the canvas
-    uint8_t processedCanvas[28*28];
-    preprocessCanvas(ui->canvas, processedCanvas);
-    
-    // Get the correct cellSize - MUST match what was used in training
-    int cellSize = CELL_SIZE;
-    int numBins = NUM_BINS;
-    
-    // IMPORTANT: Calculate numFeatures the same way it was calculated during training
-    int numFeatures = (28/cellSize) * (28/cellSize) * numBins;
-    
-    // Verify feature dimensions match the model
-    if (numFeatures != ui->model->numFeatures) {
-        printf("ERROR: Feature dimension mismatch! Expected: %d, Got: %d\n", 
-               ui->model->numFeatures, numFeatures);
-        printf("This is likely due to a cell size mismatch between training and prediction.\n");
+    // Mid-stroke streaming requests leave out the visualization, keeping the
+    // per-frame path to preprocessing, HOG and scoring
+    int visualize = ui->vizMode == VIZ_MODE_HOG && !(ui->streaming && ui->drawing);
+    ui->pendingSequence = requestPrediction(ui->worker, ui->canvas, visualize, ui->lastInputTime);
+}
+
+// Show the worker's latest result if it is newer than the one on screen.
+// While streaming, a slow model answers requests that newer snapshots have
+// already replaced; those results are still shown, so predictions keep up
+// with the stroke. Only results from before a clear or a new stroke are dropped.
+void applyPredictionResult(DrawingUI *ui) {
+    const PredictionResult *result = takePredictionResult(ui->worker);
+    if (result == NULL || result->sequence <= ui->epochSequence ||
+        result->sequence <= ui->lastShownSequence) {
         return;
     }
-    
-    // Create a temporary dataset to extract HOG features
-    MNISTDataset tempDataset;
-    tempDataset.numImages = 1;
-    tempDataset.imageSize = 28*28;
-    tempDataset.rows = 28;
-    tempDataset.cols = 28;
-    tempDataset.images = processedCanvas;  // Use the processed image
-    tempDataset.labels = NULL;  // Not needed for prediction
-    
-    // Create HOG features structure and initialize all fields
-    HOGFeatures hogFeatures;
-    hogFeatures.numImages = 1;
-    hogFeatures.numFeatures = numFeatures;  // Use the calculated value
-    hogFeatures.labels = NULL; 
-    
-    // Allocate memory for features
-    hogFeatures.features = (double*)malloc(hogFeatures.numFeatures * sizeof(double));
-    if (hogFeatures.features == NULL) {
-        printf("Failed to allocate memory for HOG features\n");
-        return;
+    if (result->sequence == ui->pendingSequence) {
+        ui->pendingSequence = 0;  // The newest request is answered; nothing is in flight
     }
-    
-    // Initialize features memory to zeros
-    memset(hogFeatures.features, 0, hogFeatures.numFeatures * sizeof(double));
-    
-    // Extract HOG features using the correct cell size
-    extractHOGFeatures(&tempDataset, &hogFeatures, cellSize, numBins);
-    
-    // Store all log probabilities
-    double *logProbs = (double*)malloc(ui->numClasses * sizeof(double));
-    if (logProbs == NULL) {
-        printf("Failed to allocate memory for log probabilities\n");
-        free(hogFeatures.features);
+    if (result->prediction < 0) {
         return;
     }
-    
-    // Calculate log probabilities directly
-    double maxLogProb = -INFINITY;
-    int bestClass = 0;
-    
-    for (int c = 0; c < ui->numClasses; c++) {
-        // Start with class prior probability
-        double logProb = log(ui->model->classPrior[c]);
-        
-        // Add log probability for each feature
-        for (int f = 0; f < ui->model->numFeatures; f++) {
-            // Ensure feature value is in valid range
-            double featureVal = hogFeatures.features[f];
-            featureVal = (featureVal < 0) ? 0 : (featureVal > 1.0 ? 1.0 : featureVal);
-            
-            // Calculate bin index
-            int bin = (int)(featureVal / ui->model->binWidth);
-            bin = (bin < 0) ? 0 : (bin >= ui->model->numBins ? ui->model->numBins - 1 : bin);
-            
-            // Get probability for this feature, with safety check
-            double prob = ui->model->featureProb[c][f][bin];
-            prob = (prob < 1e-10) ? 1e-10 : prob;  // Prevent log(0)
-            
-            logProb += log(prob);
-        }
-        
-        // Store this class's log probability
-        logProbs[c] = logProb;
-        
-        // Keep track of best class
-        if (logProb > maxLogProb) {
-            maxLogProb = logProb;
-            bestClass = c;
-        }
-    }
-    
-    // Set prediction
-    ui->prediction = bestClass;
-    
-    // Apply a temperature parameter to soften the confidence scores
-    double temperature = 2.5;  // Higher values = softer distribution
-    double totalProb = 0.0;
-    
-    // Convert log probabilities to actual probabilities using softmax with temperature
-    for (int c = 0; c < ui->numClasses; c++) {
-        ui->confidence[c] = exp((logProbs[c] - maxLogProb) / temperature);
-        totalProb += ui->confidence[c];
-    }
-    
-    // Normalize to get confidence scores
-    if (totalProb > 0) {
-        for (int c = 0; c < ui->numClasses; c++) {
-            ui->confidence[c] /= totalProb;
-        }
-    }
-    
+    ui->lastShownSequence = result->sequence;
+    ui->needsRedraw = 1;
+
+    ui->prediction = result->prediction;
+    memcpy(ui->confidence, result->confidence, sizeof(ui->confidence));
+    ui->latencyMs = 1000.0 * (SDL_GetPerformanceCounter() - result->inputTime) / SDL_GetPerformanceFrequency();
+    ui->computeMs = result->computeMs;
+    ui->cellsRecomputed = result->cellsRecomputed;
+
     // Copy processed canvas to a separate place to display for debugging
-    memcpy(ui->processedCanvas, processedCanvas, 28*28);
+    memcpy(ui->processedCanvas, result->processedCanvas, 28*28);
+    ui->processedChanged = 1;
     ui->showProcessed = 1;
-    
-    // Print the prediction for debugging
-    printf("Predicted: %c with confidence %.2f%%\n", 
-          ui->showingLetters ? 'A' + ui->prediction : '0' + ui->prediction,
-          ui->confidence[ui->prediction] * 100.0);
-    
-    // Store the extracted features for visualization if in HOG mode
-    if (ui->vizMode == VIZ_MODE_HOG) {
-        // Allocate/reallocate memory for features if needed
-        if (ui->lastFeatures == NULL || ui->lastFeaturesCount != hogFeatures.numFeatures) {
-            // Free old memory if it exists
-            if (ui->lastFeatures != NULL) {
-                free(ui->lastFeatures);
-            }
-            
-            // Allocate new memory
-            ui->lastFeatures = (double*)malloc(hogFeatures.numFeatures * sizeof(double));
-            if (ui->lastFeatures != NULL) {
-                ui->lastFeaturesCount = hogFeatures.numFeatures;
-            } else {
-                ui->lastFeaturesCount = 0;
-                printf("Failed to allocate memory for feature storage\n");
-            }
-        }
-        
-        // Copy features if memory allocation succeeded
-        if (ui->lastFeatures != NULL) {
-            memcpy(ui->lastFeatures, hogFeatures.features, 
-                hogFeatures.numFeatures * sizeof(double));
-                
-            // Generate the HOG visualization
-            visualizeHOGFeatures(ui, hogFeatures.features, bestClass);
-        }
-    }
 
+    // Print the prediction for debugging, once per stroke when streaming
+    if (!(ui->streaming && ui->drawing)) {
+        printf("Predicted: %c with confidence %.2f%% (%.1f ms after input)\n", 
+              ui->showingLetters ? 'A' + ui->prediction : '0' + ui->prediction,
+              ui->confidence[ui->prediction] * 100.0, ui->latencyMs);
+    }
 
-    
-    // Free allocated memory in reverse order of allocation
-    free(logProbs);
-    free(hogFeatures.features);
-    // Add this right at the end of processPrediction() before returning
-    // This makes sure we keep the processed view visible for better user feedback
-    ui->showProcessed = 1;
+    // The HOG visualization, if the request asked for one
+    if (result->viz.hasData) {
+        gHOGViz = result->viz;
+        ui->hogChanged = 1;
+    }
 }
\ No newline at end of file
@@ -11,11 +11,25 @@
 #define VIZ_MODE_REFERENCE 2
 #define VIZ_MODE_HOG 3
 
+// HOG parameters of the recognizer's features; MUST match the ones used in training
+#define CELL_SIZE 4
+#define NUM_BINS 9
+
+struct PredictionWorker;
+
 // Structure to hold UI components
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
-    SDL_Texture *canvasTexture;
+    SDL_Texture *canvasTexture;    // Streaming RGBA textures of the 28x28 views,
+    SDL_Texture *processedTexture; // uploaded only when their pixels change
+    SDL_Texture *hogTexture;       // Processed image under the HOG arrows
+    SDL_Texture *referenceTexture; // Reference samples of one letter, side by side
+    int canvasChanged;             // canvas is newer than canvasTexture
+    int processedChanged;          // processedCanvas is newer than processedTexture
+    int hogChanged;                // gHOGViz is newer than hogTexture
+    int referenceLetter;           // Letter whose samples are in referenceTexture (-1 for none)
+    int needsRedraw;               // Something visible changed since the last frame
     uint8_t canvas[28*28];         // 28x28 pixel canvas for drawing
     uint8_t processedCanvas[28*28]; // Processed version for debugging
     int vizMode;                    // Visualization mode flag
@@ -26,8 +40,15 @@ typedef struct {
     int showingLetters;            // 0 for digits, 1 for letters
     double confidence[26];         // Confidence scores for each class
     int prediction;                // Current prediction
-    double *lastFeatures;          // Store last extracted features for visualization
-    int lastFeaturesCount;         // Number of features stored
+    struct PredictionWorker *worker; // Runs predictions off the event/render thread
+    uint32_t pendingSequence;      // Newest request not answered yet (0 for none)
+    uint32_t epochSequence;        // Requests up to this one predate the last clear or stroke start
+    uint32_t lastShownSequence;    // Request whose result is on screen
+    int streaming;                 // Predict every frame while drawing instead of after a pause
+    Uint64 lastInputTime;          // Performance counter at the last canvas change
+    double latencyMs;              // Input to result of the last prediction shown (<0 before any)
+    double computeMs;              // Worker time of the last prediction shown
+    int cellsRecomputed;           // HOG cells the last prediction shown had to recompute
 } DrawingUI;
 
 // Structure to hold HOG visualization data
@@ -59,29 +80,34 @@ void cleanupUI(DrawingUI *ui);
 // Process events (mouse, keyboard, etc.)
 int processEvents(DrawingUI *ui);
 
-// Draw the canvas and UI elements
+// Draw the canvas and UI elements, if anything changed since the last frame
 void renderUI(DrawingUI *ui);
 
+// Nothing is being drawn, waited for or animated, so the main loop can sleep until the next event
+int isUIIdle(const DrawingUI *ui);
+
 // Clear the canvas
 void clearCanvas(DrawingUI *ui);
 
-// Process the current drawing and make a prediction
+// Hand a snapshot of the current drawing to the prediction worker
 void processPrediction(DrawingUI *ui);
 
-// Preprocess the canvas for better recognition
-void preprocessCanvas(uint8_t *canvas, uint8_t *processedCanvas);
+// Show the newest result the worker has finished for the current drawing
+void applyPredictionResult(DrawingUI *ui);
 
 // Load reference samples from training data
 int loadReferenceSamples(const char* imageFile, const char* labelFile);
 
-// Visualize HOG features
-void visualizeHOGFeatures(DrawingUI *ui, double *features, uint8_t predictedClass);
+// Visualize how the HOG features of processedCanvas support predictedClass
+void visualizeHOGFeatures(const NaiveBayesModel *model, const uint8_t *processedCanvas,
+                          const double *features, uint8_t predictedClass, HOGVisualization *viz);
 
 // Render HOG visualization
-void renderHOGVisualization(SDL_Renderer *renderer, int x, int y, int size);
+void renderHOGVisualization(SDL_Renderer *renderer, SDL_Texture *imageTexture, int x, int y, int size);
 
-// Render reference samples
-void renderReferenceSamples(SDL_Renderer *renderer, int x, int y, int width, int height, int letterIndex);
+// Render reference samples; samplesTexture must hold those of letterIndex
+void renderReferenceSamples(SDL_Renderer *renderer, SDL_Texture *samplesTexture,
+                            int x, int y, int width, int height, int letterIndex);
 
 // Change visualization mode
 void cycleVisualizationMode(DrawingUI *ui);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <time.h>
 #include "utils.h"
 
 // Function to convert from MSB first (big-endian) to host format
@@ -7,4 +8,11 @@ uint32_t convert_endian(uint32_t value) {
            ((value << 8) & 0xff0000) | 
            ((value >> 8) & 0xff00) | 
            ((value << 24) & 0xff000000);
+}
+
+// Function to read a monotonic clock in seconds, for timing
+double getTimeSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
\ No newline at end of file
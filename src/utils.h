@@ -6,4 +6,7 @@
 // Function to convert from MSB first (big-endian) to host format
 uint32_t convert_endian(uint32_t value);
 
+// Function to read a monotonic clock in seconds, for timing
+double getTimeSeconds(void);
+
 #endif // UTILS_H
\ No newline at end of file
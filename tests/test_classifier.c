@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "mnist_loader.h"
+#include "hog.h"
+#include "naive_bayes.h"
+#include "classifier.h"
+
+// Deterministic checks of the classifier's exactness claims on a small
+// synthetic model. Run with "make test"; exits non-zero on any failure.
+
+#define ROWS 28
+#define COLS 28
+#define CELL_SIZE 4
+#define NUM_BINS 9
+#define MODEL_BINS 16
+#define NUM_CLASSES 5
+#define NUM_FEATURES ((ROWS/CELL_SIZE) * (COLS/CELL_SIZE) * NUM_BINS)
+#define NUM_CELLS ((ROWS/CELL_SIZE) * (COLS/CELL_SIZE))
+#define TRAIN_PER_CLASS 40
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+} while (0)
+
+// Small LCG so every run sees the same images
+static uint32_t rngState = 12345;
+
+static uint32_t nextRandom(void) {
+    rngState = rngState * 1664525u + 1013904223u;
+    return rngState >> 8;
+}
+
+// Paint a 3x3 dot centered at (x, y)
+static void paintDot(uint8_t *image, int x, int y) {
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int px = x + dx, py = y + dy;
+            if (px >= 0 && px < COLS && py >= 0 && py < ROWS) {
+                image[py * COLS + px] = 255;
+            }
+        }
+    }
+}
+
+// A stroke whose direction depends on the class, jittered per image
+static void drawClassImage(uint8_t *image, int label) {
+    static const int directions[NUM_CLASSES][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}, {2, 1}};
+    memset(image, 0, ROWS * COLS);
+    int x = 8 + (int)(nextRandom() % 5);
+    int y = 8 + (int)(nextRandom() % 5);
+    if (directions[label][1] < 0) {
+        y += 10;
+    }
+    for (int step = 0; step < 12; step++) {
+        paintDot(image, x + step * directions[label][0], y + step * directions[label][1]);
+    }
+}
+
+static bool trainSyntheticModel(NaiveBayesModel *model) {
+    static uint8_t images[NUM_CLASSES * TRAIN_PER_CLASS][ROWS * COLS];
+    static uint8_t labels[NUM_CLASSES * TRAIN_PER_CLASS];
+    for (int i = 0; i < NUM_CLASSES * TRAIN_PER_CLASS; i++) {
+        labels[i] = (uint8_t)(i % NUM_CLASSES);
+        drawClassImage(images[i], labels[i]);
+    }
+
+    MNISTDataset dataset;
+    memset(&dataset, 0, sizeof(dataset));
+    dataset.images = &images[0][0];
+    dataset.labels = labels;
+    dataset.numImages = NUM_CLASSES * TRAIN_PER_CLASS;
+    dataset.rows = ROWS;
+    dataset.cols = COLS;
+    dataset.imageSize = ROWS * COLS;
+
+    if (!initNaiveBayes(model, NUM_CLASSES, NUM_FEATURES, MODEL_BINS, 1.0)) {
+        return false;
+    }
+    return trainNaiveBayesFromDataset(model, &dataset, CELL_SIZE, NUM_BINS, 1);
+}
+
+// Features of the dirty cells recomputed after each added dot must be
+// exactly those of a full extraction
+static void testIncrementalHOG(void) {
+    uint8_t before[ROWS * COLS] = {0}, after[ROWS * COLS];
+    double incremental[NUM_FEATURES], full[NUM_FEATURES];
+    uint8_t dirtyCells[NUM_CELLS];
+
+    computeHOGImage(before, ROWS, COLS, CELL_SIZE, NUM_BINS, incremental);
+    for (int step = 0; step < 200; step++) {
+        memcpy(after, before, sizeof(after));
+        paintDot(after, (int)(nextRandom() % COLS), (int)(nextRandom() % ROWS));
+        if (step % 50 == 49) {
+            memset(after, 0, sizeof(after));  // Clearing the canvas changes every drawn cell
+        }
+
+        markChangedHOGCells(before, after, ROWS, COLS, CELL_SIZE, dirtyCells);
+        computeHOGCells(after, ROWS, COLS, CELL_SIZE, NUM_BINS, dirtyCells, incremental);
+        computeHOGImage(after, ROWS, COLS, CELL_SIZE, NUM_BINS, full);
+        CHECK(memcmp(incremental, full, sizeof(full)) == 0,
+              "incremental HOG features differ from a full extraction at step %d", step);
+        memcpy(before, after, sizeof(before));
+    }
+}
+
+// Features stored as floats for a bin count fall in the same bins as the
+// doubles they come from
+static void testFloatStorageBins(void) {
+    static uint8_t images[100][ROWS * COLS];
+    for (int i = 0; i < 100; i++) {
+        drawClassImage(images[i], i % NUM_CLASSES);
+        paintDot(images[i], (int)(nextRandom() % COLS), (int)(nextRandom() % ROWS));
+    }
+    MNISTDataset dataset;
+    memset(&dataset, 0, sizeof(dataset));
+    dataset.images = &images[0][0];
+    dataset.numImages = 100;
+    dataset.rows = ROWS;
+    dataset.cols = COLS;
+    dataset.imageSize = ROWS * COLS;
+
+    static const int binCounts[] = {9, 16, 32, 100};
+    for (size_t k = 0; k < sizeof(binCounts) / sizeof(binCounts[0]); k++) {
+        HOGFeatures doubles, floats;
+        doubles.numImages = floats.numImages = dataset.numImages;
+        doubles.numFeatures = floats.numFeatures = NUM_FEATURES;
+        extractHOGFeaturesAs(&dataset, &doubles, CELL_SIZE, NUM_BINS, HOG_STORAGE_DOUBLE, 0, 1);
+        extractHOGFeaturesAs(&dataset, &floats, CELL_SIZE, NUM_BINS, HOG_STORAGE_FLOAT, binCounts[k], 1);
+
+        uint32_t moved = 0;
+        for (size_t i = 0; i < (size_t)dataset.numImages * NUM_FEATURES; i++) {
+            moved += hogValueBin(doubles.features[i], binCounts[k]) !=
+                     hogValueBin(floats.featuresFloat[i], binCounts[k]);
+            CHECK(fabs(floats.featuresFloat[i] - doubles.features[i]) < 1e-6,
+                  "float feature %zu is %.9f, double %.9f", i, floats.featuresFloat[i], doubles.features[i]);
+        }
+        CHECK(moved == 0, "%u float features changed bin out of %d", moved, binCounts[k]);
+        freeHOGFeatures(&doubles);
+        freeHOGFeatures(&floats);
+    }
+}
+
+// Rescoring only the changed bins must track full scoring
+static void testRescore(const NaiveBayesModel *model) {
+    uint8_t oldBins[NUM_FEATURES], newBins[NUM_FEATURES];
+    double rescored[NUM_CLASSES], full[NUM_CLASSES];
+
+    for (int f = 0; f < NUM_FEATURES; f++) {
+        oldBins[f] = (uint8_t)(nextRandom() % MODEL_BINS);
+    }
+    scoreNaiveBayesBins(model, oldBins, rescored);
+    for (int step = 0; step < 100; step++) {
+        memcpy(newBins, oldBins, sizeof(newBins));
+        for (int changes = 0; changes < 10; changes++) {
+            newBins[nextRandom() % NUM_FEATURES] = (uint8_t)(nextRandom() % MODEL_BINS);
+        }
+
+        uint8_t rescoredBest = rescoreNaiveBayesBins(model, oldBins, newBins, rescored);
+        uint8_t fullBest = scoreNaiveBayesBins(model, newBins, full);
+        CHECK(rescoredBest == fullBest, "rescored class %d, full %d at step %d", rescoredBest, fullBest, step);
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            CHECK(fabs(rescored[c] - full[c]) < 1e-9,
+                  "class %d rescored to %.12f, full %.12f at step %d", c, rescored[c], full[c], step);
+        }
+        memcpy(oldBins, newBins, sizeof(oldBins));
+    }
+}
+
+// classifyImage agrees with scoring, orders its top classes and, in
+// incremental mode, gives what a fresh classification gives
+static void testClassifyImage(const NaiveBayesModel *model) {
+    ClassifierScratch fresh, incremental;
+    ClassifierResult freshResult, incrementalResult;
+    double features[NUM_FEATURES], logProbs[NUM_CLASSES];
+    uint8_t bins[NUM_FEATURES];
+    uint8_t image[ROWS * COLS];
+
+    CHECK(initClassifierScratch(&fresh, model, ROWS, COLS, CELL_SIZE, NUM_BINS), "scratch init failed");
+    CHECK(initClassifierScratch(&incremental, model, ROWS, COLS, CELL_SIZE, NUM_BINS), "scratch init failed");
+    incremental.incremental = true;
+    incremental.temperature = 2.5;
+    fresh.temperature = 2.5;
+
+    int correct = 0;
+    for (int i = 0; i < 50; i++) {
+        int label = i % NUM_CLASSES;
+        drawClassImage(image, label);
+        if (i % 3 == 0) {
+            paintDot(image, (int)(nextRandom() % COLS), (int)(nextRandom() % ROWS));
+        }
+
+        CHECK(classifyImage(model, image, &fresh, &freshResult), "classifyImage failed");
+        CHECK(classifyImage(model, image, &incremental, &incrementalResult), "incremental classifyImage failed");
+
+        computeHOGImage(image, ROWS, COLS, CELL_SIZE, NUM_BINS, features);
+        for (int f = 0; f < NUM_FEATURES; f++) {
+            bins[f] = (uint8_t)hogValueBin(features[f], model->numBins);
+        }
+        uint8_t expected = scoreNaiveBayesBins(model, bins, logProbs);
+        CHECK(freshResult.prediction == expected, "classifyImage predicted %d, scoring %d",
+              freshResult.prediction, expected);
+        CHECK(incrementalResult.prediction == expected, "incremental classifyImage predicted %d, scoring %d",
+              incrementalResult.prediction, expected);
+        correct += expected == label;
+
+        CHECK(freshResult.numTop == NUM_CLASSES, "numTop %d for %d classes", freshResult.numTop, NUM_CLASSES);
+        CHECK(freshResult.topClasses[0] == freshResult.prediction, "top class %d is not the prediction %d",
+              freshResult.topClasses[0], freshResult.prediction);
+        double total = 0.0;
+        for (int k = 0; k < freshResult.numTop; k++) {
+            total += freshResult.topConfidences[k];
+            CHECK(freshResult.topConfidences[k] == fresh.confidence[freshResult.topClasses[k]],
+                  "top confidence %d doesn't match its class", k);
+            CHECK(fabs(incrementalResult.topConfidences[k] - freshResult.topConfidences[k]) < 1e-9,
+                  "incremental confidence %d differs", k);
+            if (k > 0) {
+                CHECK(freshResult.topConfidences[k] <= freshResult.topConfidences[k - 1],
+                      "top confidences out of order at %d", k);
+            }
+        }
+        CHECK(fabs(total - 1.0) < 1e-9, "confidences of all classes sum to %.12f", total);
+    }
+    CHECK(correct >= 45, "synthetic model classifies only %d/50 images", correct);
+
+    freeClassifierScratch(&fresh);
+    freeClassifierScratch(&incremental);
+}
+
+// An untrained model scores every class the same: the lowest class wins and
+// the top classes come in class order with equal confidences
+static void testClassifyTies(void) {
+    NaiveBayesModel model;
+    ClassifierScratch scratch;
+    ClassifierResult result;
+    uint8_t image[ROWS * COLS];
+
+    CHECK(initNaiveBayes(&model, NUM_CLASSES + 2, NUM_FEATURES, MODEL_BINS, 1.0), "model init failed");
+    CHECK(initClassifierScratch(&scratch, &model, ROWS, COLS, CELL_SIZE, NUM_BINS), "scratch init failed");
+    drawClassImage(image, 0);
+
+    CHECK(classifyImage(&model, image, &scratch, &result), "classifyImage failed");
+    CHECK(result.prediction == 0, "tied prediction is %d, not 0", result.prediction);
+    CHECK(result.numTop == CLASSIFIER_TOP_K, "numTop %d with %d classes", result.numTop, NUM_CLASSES + 2);
+    for (int k = 0; k < result.numTop; k++) {
+        CHECK(result.topClasses[k] == k, "tied top class %d is %d", k, result.topClasses[k]);
+        CHECK(fabs(result.topConfidences[k] - 1.0 / (NUM_CLASSES + 2)) < 1e-12,
+              "tied confidence %d is %.12f", k, result.topConfidences[k]);
+    }
+
+    freeClassifierScratch(&scratch);
+    freeNaiveBayes(&model);
+}
+
+// A scratch set up for another model shape is refused
+static void testScratchMismatch(const NaiveBayesModel *model) {
+    NaiveBayesModel other;
+    ClassifierScratch scratch, wrongCells;
+    ClassifierResult result;
+    uint8_t image[ROWS * COLS] = {0};
+
+    CHECK(initNaiveBayes(&other, NUM_CLASSES + 1, NUM_FEATURES, MODEL_BINS, 1.0), "model init failed");
+    CHECK(initClassifierScratch(&scratch, &other, ROWS, COLS, CELL_SIZE, NUM_BINS), "scratch init failed");
+    CHECK(!classifyImage(model, image, &scratch, &result), "classifyImage accepted a mismatched scratch");
+    CHECK(!initClassifierScratch(&wrongCells, model, ROWS, COLS, CELL_SIZE * 2, NUM_BINS),
+          "scratch accepted the wrong cell size");
+
+    freeClassifierScratch(&scratch);
+    freeNaiveBayes(&other);
+}
+
+int main(void) {
+    NaiveBayesModel model;
+    if (!trainSyntheticModel(&model)) {
+        printf("FAIL: could not train the synthetic model\n");
+        return 1;
+    }
+
+    testFloatStorageBins();
+    testIncrementalHOG();
+    testRescore(&model);
+    testClassifyImage(&model);
+    testClassifyTies();
+    testScratchMismatch(&model);
+
+    freeNaiveBayes(&model);
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All classifier tests passed\n");
+    return 0;
+}
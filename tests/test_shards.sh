@@ -0,0 +1,80 @@
+#!/bin/sh
+# Sharded training must be exact: train a synthetic dataset in shards, each in
+# its own process, merge the shard models and compare the result byte for byte
+# with a model trained on the whole set. Run with "make test", or as
+#   tests/test_shards.sh bin/mnist_classifier
+
+CLASSIFIER="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+NUM_IMAGES=1000
+NUM_SHARDS=3
+
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+mkdir "$WORK/data"
+cd "$WORK" || exit 1
+
+# Big-endian 32-bit value, as IDX headers store them
+writeU32() {
+    for shift in 24 16 8 0; do
+        printf "\\$(printf '%03o' $(( ($1 >> shift) & 255 )))"
+    done
+}
+
+# IDX image and label files of NUM_IMAGES noise images, labelled first..last
+# in turn
+writeDataset() {
+    imageFile=$1 labelFile=$2 first=$3 last=$4
+    { writeU32 2051; writeU32 $NUM_IMAGES; writeU32 28; writeU32 28
+      head -c $((NUM_IMAGES * 28 * 28)) /dev/urandom; } > "$imageFile"
+
+    label=$first
+    while [ $label -le $last ]; do
+        printf "\\$(printf '%03o' $label)"
+        label=$((label + 1))
+    done > pattern
+    : > labels
+    while [ "$(wc -c < labels)" -lt $NUM_IMAGES ]; do
+        cat pattern >> labels
+    done
+    { writeU32 2049; writeU32 $NUM_IMAGES; head -c $NUM_IMAGES labels; } > "$labelFile"
+}
+
+# Run the classifier, showing its output only if it fails
+run() {
+    if ! "$CLASSIFIER" "$@" > "$WORK/log" 2>&1; then
+        cat "$WORK/log"
+        echo "FAIL: mnist_classifier $*"
+        exit 1
+    fi
+}
+
+writeDataset data/train-images-idx3-ubyte data/train-labels-idx1-ubyte 0 9
+writeDataset data/emnist-letters-train-images-idx3-ubyte data/emnist-letters-train-labels-idx1-ubyte 1 26
+
+for kind in digits letters; do
+    run train $kind full.nb
+
+    pids=""
+    shard=0
+    while [ $shard -lt $NUM_SHARDS ]; do
+        "$CLASSIFIER" --shard $shard/$NUM_SHARDS train $kind shard$shard.nb > shard$shard.log 2>&1 &
+        pids="$pids $!"
+        shard=$((shard + 1))
+    done
+    for pid in $pids; do
+        if ! wait $pid; then
+            cat shard*.log
+            echo "FAIL: training a $kind shard"
+            exit 1
+        fi
+    done
+
+    run merge merged.nb $(ls shard*.nb)
+    if ! cmp full.nb merged.nb; then
+        echo "FAIL: merged $kind shards differ from the model trained on all images"
+        exit 1
+    fi
+    rm -f full.nb merged.nb shard*.nb shard*.log
+done
+
+echo "Merged shard models match full training"